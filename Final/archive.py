@@ -0,0 +1,218 @@
+#!/usr/bin/python2
+
+"""
+Capture archive: append-only container of synchronized (nir, rgb) captures.
+
+The data file starts with a one page header, followed by the records. Each
+record holds the nir frame, the rgb frame and a JSON metadata block, every
+one of them starting on a page boundary, so that a raw frame (rawframe.py)
+can be mapped and processed in place. Encoded (JPEG) frames are stored as
+they were received.
+
+The index is a sidecar file (<archive>.idx) of fixed-size entries giving the
+location of every record, its timestamp, the servo pose and the registration
+homography. An entry is appended once its record is completely written, so
+an interrupted capture never leaves a partial record in the index. Both
+files are only ever appended to and are read through mmap.
+
+    ./archive.py <archive>    lists the records of an archive
+"""
+
+import json
+import mmap
+import os
+import struct
+import sys
+
+import numpy
+
+import rawframe
+
+magic = b'NIRA'
+index_magic = b'NIRI'
+version = 1
+page_size = 4096
+
+# data file header: magic, version, page size
+header_struct = struct.Struct('<4sII')
+
+# index header: magic, version, entry size
+index_header_struct = struct.Struct('<4sII')
+index_header_size = 64
+
+# index entry: nir offset and size, rgb offset and size, metadata offset and
+# size, timestamp, pan and tilt servo pulse widths (us), homography (row
+# major, NaN if the capture wasn't registered)
+entry_struct = struct.Struct('<QQQQQQdII9d')
+entry_dtype = numpy.dtype([
+    ('nir_offset', '<u8'), ('nir_size', '<u8'),
+    ('rgb_offset', '<u8'), ('rgb_size', '<u8'),
+    ('meta_offset', '<u8'), ('meta_size', '<u8'),
+    ('timestamp', '<f8'), ('pan', '<u4'), ('tilt', '<u4'),
+    ('homography', '<f8', (3, 3)),
+])
+
+def index_filename(filename):
+    return filename + '.idx'
+
+def align(value):
+    return (value + page_size - 1) // page_size * page_size
+
+
+class Record(object):
+    """
+    One capture of an archive. nir and rgb are rawframe.RawFrame (mapped,
+    not copied) or the bytes of the encoded images, pose is (pan, tilt) in
+    servo pulse width, homography a 3x3 array or None and meta the metadata
+    dictionary (operation, processing parameters...).
+    """
+
+    def __init__(self, index, nir, rgb, timestamp, pose, homography, meta):
+        self.index = index
+        self.nir = nir
+        self.rgb = rgb
+        self.timestamp = timestamp
+        self.pose = pose
+        self.homography = homography
+        self.meta = meta
+
+    def is_raw(self):
+        return isinstance(self.nir, rawframe.RawFrame)
+
+
+class Writer(object):
+    """
+    Appends captures to an archive, which is created if it doesn't exist.
+    """
+
+    def __init__(self, filename):
+        self.filename = filename
+        if not os.path.exists(filename):
+            with open(filename, 'wb') as f:
+                f.write(header_struct.pack(magic, version, page_size).ljust(page_size, b'\0'))
+        else:
+            check_header(filename)
+        index = index_filename(filename)
+        index_size = os.path.getsize(index) if os.path.exists(index) else 0
+        if index_size < index_header_size:
+            # an archive interrupted before its index was created: the index
+            # can only be started again if no record was written yet
+            if os.path.getsize(filename) > page_size:
+                raise ValueError('capture archive %s has records but no index %s' % (filename, index))
+            with open(index, 'wb') as f:
+                f.write(index_header_struct.pack(index_magic, version, entry_struct.size).ljust(index_header_size, b'\0'))
+        else:
+            with open(index, 'rb') as f:
+                check_index_header(index, f.read(index_header_struct.size))
+        self.data = open(filename, 'r+b')
+        self.index = open(index, 'r+b')
+        # a partially written entry at the end is dropped, so that the
+        # entries appended after it stay aligned
+        self.index.seek(0, os.SEEK_END)
+        count = (self.index.tell() - index_header_size) // entry_struct.size
+        self.index.truncate(index_header_size + count * entry_struct.size)
+        self.index.seek(0, os.SEEK_END)
+
+    def write_block(self, chunks):
+        # writes chunks at the next page boundary and returns (offset, size)
+        self.data.seek(0, os.SEEK_END)
+        offset = align(self.data.tell())
+        self.data.seek(offset)
+        size = 0
+        for chunk in chunks:
+            self.data.write(chunk)
+            size += len(chunk)
+        return offset, size
+
+    def frame_chunks(self, frame):
+        if isinstance(frame, rawframe.RawFrame):
+            return [frame.header.pack(), memoryview(frame.payload)]
+        return [frame]
+
+    def append(self, nir, rgb, timestamp, pose=(0, 0), homography=None, meta=None):
+        """
+        Appends a capture. nir and rgb are raw frames or encoded images
+        (bytes), pose the (pan, tilt) servo pulse widths.
+        """
+        nir_offset, nir_size = self.write_block(self.frame_chunks(nir))
+        rgb_offset, rgb_size = self.write_block(self.frame_chunks(rgb))
+        meta_offset, meta_size = self.write_block([json.dumps(meta or {}, sort_keys=True).encode('utf-8')])
+        self.data.flush()
+
+        if homography is None:
+            homography = numpy.full((3, 3), numpy.nan)
+        entry = entry_struct.pack(nir_offset, nir_size, rgb_offset, rgb_size, meta_offset, meta_size,
+                                  timestamp, pose[0], pose[1], *numpy.asarray(homography, numpy.float64).ravel())
+        self.index.write(entry)
+        self.index.flush()
+
+    def close(self):
+        self.data.close()
+        self.index.close()
+
+
+def check_header(filename):
+    with open(filename, 'rb') as f:
+        file_magic, file_version, file_page_size = header_struct.unpack(f.read(header_struct.size))
+    if file_magic != magic:
+        raise ValueError('%s is not a capture archive' % filename)
+    if file_version != version or file_page_size != page_size:
+        raise ValueError('unsupported capture archive version %d' % file_version)
+
+def check_index_header(filename, header):
+    index_magic_read, index_version, entry_size = index_header_struct.unpack(header)
+    if index_magic_read != index_magic or index_version != version or entry_size != entry_struct.size:
+        raise ValueError('unsupported capture archive index %s' % filename)
+
+def map_file(filename):
+    with open(filename, 'rb') as f:
+        return mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+
+
+class Reader(object):
+    """
+    Read-only view of an archive. Only the records indexed when the archive
+    is opened are visible.
+    """
+
+    def __init__(self, filename):
+        check_header(filename)
+        self.filename = filename
+        self.data = map_file(filename)
+        if os.path.getsize(index_filename(filename)) < index_header_size:
+            raise ValueError('capture archive index %s has no header' % index_filename(filename))
+        index = map_file(index_filename(filename))
+        check_index_header(index_filename(filename), index[:index_header_struct.size])
+        # a partially written entry at the end is ignored
+        count = (len(index) - index_header_size) // entry_struct.size
+        self.entries = numpy.frombuffer(index, entry_dtype, count, index_header_size)
+
+    def __len__(self):
+        return len(self.entries)
+
+    def __iter__(self):
+        for i in range(len(self)):
+            yield self[i]
+
+    def frame(self, offset, size):
+        if rawframe.is_raw_frame(self.data, offset):
+            return rawframe.from_buffer(self.data, offset)
+        return self.data[offset:offset + size]
+
+    def __getitem__(self, i):
+        e = self.entries[i]
+        meta = json.loads(self.data[e['meta_offset']:e['meta_offset'] + e['meta_size']].decode('utf-8'))
+        homography = e['homography'] if not numpy.isnan(e['homography']).any() else None
+        return Record(i, self.frame(e['nir_offset'], e['nir_size']), self.frame(e['rgb_offset'], e['rgb_size']),
+                      float(e['timestamp']), (int(e['pan']), int(e['tilt'])), homography, meta)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        print('usage: %s <archive>' % sys.argv[0])
+        sys.exit(1)
+    for record in Reader(sys.argv[1]):
+        print('%4d %.6f pan %4d tilt %4d %-4s %s %s' % (
+            record.index, record.timestamp, record.pose[0], record.pose[1],
+            'raw' if record.is_raw() else 'jpeg', 'registered' if record.homography is not None else '-',
+            record.meta.get('operation', '')))
@@ -0,0 +1,355 @@
+#!/usr/bin/python2
+
+"""
+Per-stage benchmark on the reference images of the repository.
+
+Runs JPEG decoding, normalize, register, merge, shadow detection, dehazing
+and demosaicing on the reference image sets at several resolutions, and reports for every stage the wall time,
+peak resident memory and throughput. At the original resolution, the output
+is compared with the stored reference image (PSNR for images, IoU for shadow
+masks) and the benchmark fails if it drifts beyond the tolerance.
+
+Usage:
+    ./benchmark.py [--scales 0.5,1,2] [--repeat 3] [--stages normalize,merge]
+"""
+
+import argparse
+import io
+import multiprocessing
+import os
+import resource
+import sys
+import time
+
+import cv2
+import numpy
+from PIL import Image
+
+import decode
+import dehazing
+import demosaic
+import merging
+import normalization
+import pixel
+import registration
+import shadow_detection
+
+# reference data lives at the root of the repository
+root = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# quality tolerances against the reference outputs
+min_psnr_db = 30.0
+min_registration_psnr_db = 15.0
+min_iou = 0.9
+# bound of the low resolution shadow detection (--min-lowres-iou)
+min_lowres_iou = 0.8
+# dehazing of the synthetic haze, against the haze-free image
+min_dehazing_psnr_db = 18.0
+# separation of the synthetic RGB-NIR mosaics, against the aligned pair
+min_demosaic_psnr_db = 30.0
+
+# synthetic haze of the dehazing cases: transmission at the top and the
+# bottom of the image, and airlight (BGR)
+haze_transmission = (0.35, 0.95)
+haze_airlight = (0.85, 0.88, 0.9)
+
+default_scales = [0.5, 1.0, 2.0]
+default_repeat = 3
+
+def path(*names):
+    return os.path.join(root, *names)
+
+def load(filename, flags, scale):
+    image = cv2.imread(path(filename), flags)
+    if image is None:
+        raise IOError('cannot read %s' % filename)
+    if scale != 1.0:
+        image = cv2.resize(image, None, fx=scale, fy=scale, interpolation=cv2.INTER_AREA if scale < 1 else cv2.INTER_LINEAR)
+    return image
+
+def gray(filename):
+    return lambda scale: load(filename, cv2.IMREAD_GRAYSCALE, scale)
+
+def color(filename):
+    return lambda scale: load(filename, cv2.IMREAD_COLOR, scale)
+
+def high_bit_depth(loader, bits=10):
+    # image of the loader as the sensor's raw data of the given bit depth
+    # would enter the pipeline: uint16, shifted to full scale
+    def load_high_bit_depth(scale):
+        image = loader(scale).astype(numpy.uint16)
+        return pixel.full_scale(numpy.left_shift(image, bits - 8), bits)
+    return load_high_bit_depth
+
+def hazy(loader):
+    # image of the loader seen through haze thickening towards the top of the
+    # image, with the haze model I = J t + A (1 - t) (the nir image of the
+    # scene is not affected)
+    def load_hazy(scale):
+        image = loader(scale)
+        t = numpy.linspace(haze_transmission[0], haze_transmission[1], image.shape[0], dtype=numpy.float32)
+        t = t[:, numpy.newaxis, numpy.newaxis]
+        airlight = numpy.array(haze_airlight, numpy.float32)
+        return pixel.from_float(pixel.to_float(image) * t + airlight * (1 - t), image.dtype)
+    return load_hazy
+
+def rgbn_mosaic(directory, nir, bits=8):
+    # mosaic an RGB-NIR sensor would capture of the aligned pair of a set, as
+    # it enters the pipeline (full scale uint16 with bits > 8)
+    def load_mosaic(scale):
+        rgb = load(directory + 'rgb.jpg', cv2.IMREAD_COLOR, scale)
+        nir_image = load(directory + nir, cv2.IMREAD_GRAYSCALE, scale)
+        if bits == 8:
+            return demosaic.mosaic(rgb, nir_image, numpy.uint8)
+        raw = demosaic.mosaic(rgb, nir_image, numpy.uint16)
+        return pixel.full_scale(numpy.right_shift(raw, 16 - bits), bits)
+    return load_mosaic
+
+def jpeg(filename):
+    # encoded image, re-encoded when resized
+    def load_jpeg(scale):
+        if scale == 1.0:
+            with open(path(filename), 'rb') as f:
+                return f.read()
+        return cv2.imencode('.jpg', load(filename, cv2.IMREAD_COLOR, scale))[1].tobytes()
+    return load_jpeg
+
+def iou(output, reference):
+    union = numpy.count_nonzero(output | reference)
+    if union == 0:
+        return 1.0
+    return numpy.count_nonzero(output & reference) / float(union)
+
+def image_check(minimum):
+    # compares an output image with a reference image file
+    def check(output, filename):
+        reference = cv2.imread(path(filename), cv2.IMREAD_UNCHANGED)
+        value = pixel.psnr(pixel.to_uint8(output), reference)
+        return 'PSNR', value, value >= minimum
+    return check
+
+def mask_check(minimum):
+    # compares a shadow mask with a reference mask image file (white = shadow),
+    # minimum is a value or a function returning it
+    def check(output, filename):
+        if hasattr(output, 'toArray'):
+            output = output.toArray()
+        reference = cv2.imread(path(filename), cv2.IMREAD_GRAYSCALE) >= 128
+        value = iou(output != 0, reference)
+        return 'IoU', value, value >= (minimum() if callable(minimum) else minimum)
+    return check
+
+def demosaic_check(minimum, nir):
+    # compares the separated (nir, rgb) images with the aligned pair of a set
+    # directory, the lower of the two PSNRs
+    def check(output, directory):
+        references = (cv2.imread(path(directory + nir), cv2.IMREAD_GRAYSCALE),
+                      cv2.imread(path(directory + 'rgb.jpg'), cv2.IMREAD_COLOR))
+        value = min(pixel.psnr(pixel.to_uint8(image), reference) for image, reference in zip(output, references))
+        return 'PSNR', value, value >= minimum
+    return check
+
+
+class Case(object):
+    """
+    One stage run on one reference set: inputs are functions of the scale
+    returning the stage arguments, reference is the expected output at
+    scale 1 (or None if there is none). function replaces the stage function
+    for this case, to run it with other parameters.
+    """
+
+    def __init__(self, name, inputs, reference=None, check=None, function=None):
+        self.name = name
+        self.inputs = inputs
+        self.reference = reference
+        self.check = check
+        self.function = function
+
+
+def register(nir_normalized, rgb):
+    return registration.register(nir_normalized, cv2.cvtColor(rgb, cv2.COLOR_BGR2GRAY))
+
+def merge_with(d, sigmaC, sigmaS):
+    return lambda rgb, nir: merging.merge(rgb, nir, d, sigmaC, sigmaS)
+
+d15 = 'skin_smoothing_photos/d15_sigmac10_sigmas5/'
+d30 = 'skin_smoothing_photos/d30_sigmac15_sigmas5/'
+# (directory, nir image, reference): the registered nir image of the second
+# set is not stored, so its output is not compared
+shadow_sets = [
+    ('shadow_detection_photos/1/', 'nir_registered.jpg', 'shadow_detection.jpg'),
+    ('shadow_detection_photos/2/', 'nir_normalized.jpg', None),
+    ('shadow_detection_photos/3/', 'nir_registered.jpg', 'shadow_detection.jpg'),
+]
+
+def shadow_cases(minimum=min_iou, bits=8):
+    # with bits > 8, the images are given as high bit depth data
+    depth = (lambda loader: loader) if bits == 8 else (lambda loader: high_bit_depth(loader, bits))
+    suffix = '' if bits == 8 else '_%dbit' % bits
+    return [Case(s.split('/')[1] + suffix, [depth(color(s + 'rgb.jpg')), depth(gray(s + nir))],
+                 s + reference if reference else None, mask_check(minimum))
+            for s, nir, reference in shadow_sets]
+
+def demosaic_cases(bits=8):
+    # sets with an aligned (registered) pair
+    suffix = '' if bits == 8 else '_%dbit' % bits
+    return [Case(name + suffix, [rgbn_mosaic(s, 'nir_registered.jpg', bits)], s,
+                 demosaic_check(min_demosaic_psnr_db, 'nir_registered.jpg'))
+            for name, s in (('d15', d15), ('1', shadow_sets[0][0]), ('3', shadow_sets[2][0]))]
+
+def decode_cases(filename):
+    return [Case(name, [jpeg(filename)], function=decode.decoder(request)) for name, request in [
+        ('color', decode.Request(3)),
+        ('luma', decode.Request(1)),
+        ('1/2', decode.Request(3, 2)),
+        ('1/4', decode.Request(3, 4)),
+        ('1/8', decode.Request(3, 8)),
+    ]]
+
+# (stage name, function, cases)
+stages = [
+    ('decode', None, decode_cases(d15 + 'rgb.jpg')),
+    ('normalize', normalization.normalize, [
+        Case('d15', [gray(d15 + 'nir.jpg')], d15 + 'nir_normalized.jpg', image_check(min_psnr_db)),
+        Case('d30', [gray(d30 + 'nir.jpg')], d30 + 'nir_normalized.jpg', image_check(min_psnr_db)),
+        Case('d15_10bit', [high_bit_depth(gray(d15 + 'nir.jpg'))], d15 + 'nir_normalized.jpg', image_check(min_psnr_db)),
+    ]),
+    ('register', register, [
+        Case('d15', [gray(d15 + 'nir_normalized.jpg'), color(d15 + 'rgb.jpg')], d15 + 'nir_registered.jpg', image_check(min_registration_psnr_db)),
+        Case('lake', [gray('registration/lake_nir.tiff'), color('registration/lake_rgb.tiff')]),
+        Case('01', [gray('registration/01_nir.tiff'), color('registration/01_rgb.tiff')]),
+    ]),
+    ('merge', merging.merge, [
+        Case('d15', [color(d15 + 'rgb.jpg'), gray(d15 + 'nir_registered.jpg')], d15 + 'skin_smoothing.jpg', image_check(min_psnr_db),
+             merge_with(15, 10, 5)),
+        Case('d15_10bit', [high_bit_depth(color(d15 + 'rgb.jpg')), high_bit_depth(gray(d15 + 'nir_registered.jpg'))],
+             d15 + 'skin_smoothing.jpg', image_check(min_psnr_db), merge_with(15, 10, 5)),
+    ]),
+    ('shadow', shadow_detection.shadowDetection, shadow_cases()),
+    ('shadow_bands', shadow_detection.shadowDetectionMask, shadow_cases() + shadow_cases(bits=10)),
+    ('shadow_lowres', shadow_detection.shadowDetectionLowRes, shadow_cases(lambda: min_lowres_iou)),
+    ('dehaze', dehazing.dehaze, [
+        Case('d15', [hazy(color(d15 + 'rgb.jpg')), gray(d15 + 'nir_registered.jpg')], d15 + 'rgb.jpg', image_check(min_dehazing_psnr_db)),
+        Case('d15_10bit', [hazy(high_bit_depth(color(d15 + 'rgb.jpg'))), high_bit_depth(gray(d15 + 'nir_registered.jpg'))],
+             d15 + 'rgb.jpg', image_check(min_dehazing_psnr_db)),
+    ]),
+    ('demosaic', demosaic.demosaic, demosaic_cases() + demosaic_cases(bits=10)),
+]
+
+def peak_rss_reset():
+    # resets the peak resident set size of the process, if the kernel allows it
+    try:
+        with open('/proc/self/clear_refs', 'w') as f:
+            f.write('5')
+        return True
+    except (IOError, OSError):
+        return False
+
+def peak_rss_kb():
+    try:
+        with open('/proc/self/status') as f:
+            for line in f:
+                if line.startswith('VmHWM:'):
+                    return int(line.split()[1])
+    except (IOError, OSError):
+        pass
+    return resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+
+def image_pixels(image):
+    # pixels of an image, or of an encoded image at full resolution
+    if isinstance(image, bytes):
+        width, height = Image.open(io.BytesIO(image)).size
+        return width * height
+    return image.shape[0] * image.shape[1]
+
+def measure(function, case, scale, repeat, connection):
+    # runs in a child process so that the peak memory of every stage is
+    # measured separately
+    try:
+        args = [load_input(scale) for load_input in case.inputs]
+        pixels = image_pixels(args[0])
+
+        peak_rss_reset()
+        base_kb = peak_rss_kb()
+
+        times = []
+        for _ in range(repeat):
+            start = time.time()
+            output = function(*args)
+            times.append(time.time() - start)
+        peak_kb = peak_rss_kb()
+
+        check = None
+        if scale == 1.0 and case.reference is not None:
+            check = case.check(output, case.reference)
+
+        connection.send((min(times), pixels, peak_kb, peak_kb - base_kb, check, None))
+    except Exception as e:
+        connection.send((None, None, None, None, None, '%s: %s' % (type(e).__name__, e)))
+    connection.close()
+
+def run(names, scales, repeat):
+    print('%-14s %-9s %6s %9s %10s %10s %9s  %s' % ('stage', 'set', 'scale', 'time [s]', 'Mpixel/s', 'peak RSS', '+RSS', 'quality'))
+
+    failures = 0
+    for name, function, cases in stages:
+        if names and name not in names:
+            continue
+        for case in cases:
+            for scale in scales:
+                receiver, sender = multiprocessing.Pipe(False)
+                f = case.function or function
+                process = multiprocessing.Process(target=measure, args=(f, case, scale, repeat, sender))
+                process.start()
+                # the child holds the only sending end: if it dies before
+                # sending (e.g. killed when out of memory), recv raises EOFError
+                sender.close()
+                try:
+                    seconds, pixels, peak_kb, delta_kb, check, error = receiver.recv()
+                except EOFError:
+                    error = 'no result'
+                process.join()
+                receiver.close()
+                if process.exitcode:
+                    error = '%s (exit code %d)' % (error or 'process failed', process.exitcode)
+
+                if error is not None:
+                    print('%-14s %-9s %6.2f  error: %s' % (name, case.name, scale, error))
+                    failures += 1
+                    continue
+
+                quality = ''
+                if check is not None:
+                    metric, value, ok = check
+                    quality = '%s %.3f %s' % (metric, value, 'ok' if ok else 'FAILED')
+                    failures += 0 if ok else 1
+
+                print('%-14s %-9s %6.2f %9.4f %10.2f %7.1f MB %6.1f MB  %s' % (
+                    name, case.name, scale, seconds, pixels / seconds / 1e6,
+                    peak_kb / 1024.0, delta_kb / 1024.0, quality))
+    return failures
+
+def main():
+    global min_lowres_iou
+    parser = argparse.ArgumentParser(description='Benchmark the processing stages on the reference images.')
+    parser.add_argument('--scales', default=','.join(str(s) for s in default_scales),
+                        help='comma separated resolution scales (default: %(default)s)')
+    parser.add_argument('--repeat', type=int, default=default_repeat,
+                        help='runs per measurement, the fastest is reported (default: %(default)s)')
+    parser.add_argument('--stages', default='',
+                        help='comma separated stages to run (default: all of %s)' % ', '.join(s[0] for s in stages))
+    parser.add_argument('--min-lowres-iou', type=float, default=min_lowres_iou,
+                        help='minimum IoU of the low resolution shadow detection (default: %(default)s)')
+    args = parser.parse_args()
+
+    min_lowres_iou = args.min_lowres_iou
+    scales = [float(s) for s in args.scales.split(',')]
+    names = [s for s in args.stages.split(',') if s]
+
+    failures = run(names, scales, args.repeat)
+    if failures:
+        print('%d measurement(s) failed' % failures)
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,185 @@
+"""
+Content-addressed cache of intermediate frames.
+
+A frame computed by a graph node is identified by a key hashing the node
+name, the node parameters and the keys of its inputs. Source frames are
+keyed by a hash of their content, so the key of every frame of a capture is
+known before anything is computed: when a frame is found in the cache, the
+nodes upstream of it don't run at all, and changing a parameter only
+invalidates the frames downstream of the node using it.
+
+Frames are kept in a memory tier and, if a directory is given, in a disk
+tier, both bounded in size and evicted in least recently used order.
+"""
+
+import collections
+import hashlib
+import os
+import pickle
+import threading
+
+import numpy
+
+# default bound of the memory tier
+memory_limit = 256 * 1024 * 1024
+# default bound of the disk tier
+disk_limit = 2 * 1024 * 1024 * 1024
+
+def content_key(data):
+    # hash of the content of a source frame
+    h = hashlib.sha1()
+    if isinstance(data, numpy.ndarray):
+        h.update(repr((data.shape, data.dtype.str)).encode('utf-8'))
+        h.update(numpy.ascontiguousarray(data).data)
+    elif isinstance(data, bytes):
+        h.update(data)
+    elif hasattr(data, 'header') and hasattr(data, 'payload'):
+        # rawframe.RawFrame, the layout but not the timestamp of the header
+        h.update(data.header.pack()[:32])
+        h.update(data.payload.data)
+    else:
+        h.update(repr(data).encode('utf-8'))
+    return h.hexdigest()
+
+def derived_key(name, parameters, input_keys, output):
+    # key of the output of a node, from its inputs and parameters
+    h = hashlib.sha1()
+    h.update(repr((name, sorted(parameters.items()) if parameters else None, output)).encode('utf-8'))
+    for key in input_keys:
+        h.update(key.encode('utf-8'))
+    return h.hexdigest()
+
+def size_of(data):
+    if isinstance(data, numpy.ndarray):
+        return data.nbytes
+    if hasattr(data, 'packed'):
+        # shadow_mask.ShadowMask
+        return data.packed.nbytes
+    return len(pickle.dumps(data, 2))
+
+def frozen(data):
+    # copy of the data that the cache can own: later writes to the frame
+    # (e.g. a pooled buffer reused for the next capture) must not change it
+    if isinstance(data, numpy.ndarray):
+        data = data.copy()
+        data.setflags(write=False)
+        return data
+    return pickle.loads(pickle.dumps(data, 2))
+
+
+class Cache(object):
+
+    def __init__(self, directory=None, memory_bytes=memory_limit, disk_bytes=disk_limit):
+        self.directory = directory
+        self.memory_bytes = memory_bytes
+        self.disk_bytes = disk_bytes
+        self.lock = threading.Lock()
+        self.memory = collections.OrderedDict()  # key -> (data, size)
+        self.memory_used = 0
+        self.disk = collections.OrderedDict()  # key -> size
+        self.disk_used = 0
+        self.hits = 0
+        self.disk_hits = 0
+        self.misses = 0
+        if directory is not None:
+            self.scan()
+
+    def path(self, key):
+        return os.path.join(self.directory, key[:2], key)
+
+    def scan(self):
+        # indexes the frames already on disk, least recently used first
+        entries = []
+        for root, _, files in os.walk(self.directory):
+            for name in files:
+                if '.' in name:
+                    # temporary file of an interrupted write
+                    continue
+                filename = os.path.join(root, name)
+                stat = os.stat(filename)
+                entries.append((stat.st_mtime, name, stat.st_size))
+        for _, key, size in sorted(entries):
+            self.disk[key] = size
+            self.disk_used += size
+
+    def get(self, key):
+        # cached data for key, or None
+        with self.lock:
+            if key in self.memory:
+                self.memory[key] = self.memory.pop(key)
+                self.hits += 1
+                return self.memory[key][0]
+            if key not in self.disk:
+                self.misses += 1
+                return None
+            self.disk[key] = self.disk.pop(key)
+        try:
+            with open(self.path(key), 'rb') as f:
+                data = pickle.load(f)
+            os.utime(self.path(key), None)
+        except (IOError, OSError, EOFError, pickle.UnpicklingError):
+            with self.lock:
+                self.disk_used -= self.disk.pop(key, 0)
+                self.misses += 1
+            return None
+        if isinstance(data, numpy.ndarray):
+            data.setflags(write=False)
+        with self.lock:
+            self.hits += 1
+            self.disk_hits += 1
+            self.store_memory(key, data, size_of(data))
+        return data
+
+    def put(self, key, data):
+        data = frozen(data)
+        size = size_of(data)
+        with self.lock:
+            self.store_memory(key, data, size)
+            on_disk = self.directory is None or key in self.disk
+        if not on_disk:
+            self.store_disk(key, data)
+        return data
+
+    def store_memory(self, key, data, size):
+        if key in self.memory:
+            self.memory_used -= self.memory.pop(key)[1]
+        if size > self.memory_bytes:
+            return
+        self.memory[key] = (data, size)
+        self.memory_used += size
+        while self.memory_used > self.memory_bytes:
+            _, (_, evicted) = self.memory.popitem(last=False)
+            self.memory_used -= evicted
+
+    def store_disk(self, key, data):
+        filename = self.path(key)
+        if not os.path.isdir(os.path.dirname(filename)):
+            try:
+                os.makedirs(os.path.dirname(filename))
+            except OSError:
+                pass
+        # written to a temporary file first, so that a frame is either
+        # complete or absent
+        temporary = '%s.%d.%d' % (filename, os.getpid(), threading.current_thread().ident)
+        with open(temporary, 'wb') as f:
+            pickle.dump(data, f, 2)
+        os.rename(temporary, filename)
+        size = os.path.getsize(filename)
+
+        evicted = []
+        with self.lock:
+            self.disk[key] = size
+            self.disk_used += size
+            while self.disk_used > self.disk_bytes and len(self.disk) > 1:
+                old, old_size = self.disk.popitem(last=False)
+                self.disk_used -= old_size
+                evicted.append(old)
+        for old in evicted:
+            try:
+                os.remove(self.path(old))
+            except OSError:
+                pass
+
+    def print_stats(self):
+        print('cache: %d hits (%d from disk), %d misses, %.1f MB in memory, %.1f MB on disk'
+              % (self.hits, self.disk_hits, self.misses, self.memory_used / 1048576.0, self.disk_used / 1048576.0))
@@ -1,18 +1,27 @@
 #!/usr/bin/python2
 
-import cv2
-import numpy
-import picamera
+import io
+import os
 import signal
 import socket
 import subprocess
 import sys
+import threading
 import time
-import scipy.misc
 
-import registration
-import merging
-import shadow_detection
+import archive
+import demosaic
+import mosaic
+import offload
+import pipeline
+import rawframe
+import stages
+import tracing
+
+try:
+    import picamera
+except ImportError:
+    picamera = None
 
 # constants
 master = '192.168.1.13'
@@ -21,36 +30,80 @@ host = slave
 port = 1313
 op_skin_smoothing = 'OP_SKIN_SMOOTHING'
 op_shadow_detection = 'OP_SHADOW_DETECTION'
+op_dehazing = 'OP_DEHAZING'
+op_all = 'OP_ALL'
 camera_resolution_horizontal = 640
 camera_resolution_vertical = 480
 nir_image_file = 'nir.jpg'
 rgb_image_file = 'rgb.jpg'
-nir_normalized_image_file = 'nir_normalized.jpg'
+nir_raw_file = 'nir.raw'
+rgb_raw_file = 'rgb.raw'
+rgbn_raw_file = 'rgbn.raw'
 nir_registered_image_file = 'nir_registered.jpg'
 skin_smoothing_image_file = 'skin_smoothing.jpg'
-shadow_detection_image_file = 'shadow_detection.jpg'
+shadow_detection_image_file = 'shadow_detection.png'
+dehazing_image_file = 'dehazing.jpg'
+pan_tilt_trace_file = 'pan-tilt-trace.json'
+mosaic_directory = 'mosaic'
+
+# 'jpeg', 'raw' to capture and transfer unencoded frames, or 'rgbn' to
+# capture the raw mosaic of a single RGB-NIR sensor (no server, no
+# registration, see demosaic.py)
+capture_format = os.environ.get('NIR_CAPTURE_FORMAT', 'jpeg')
+# bits per sample of the RGB-NIR sensor
+rgbn_bits = int(os.environ.get('NIR_RGBN_BITS', demosaic.sensor_bits))
+# process a reduced copy of every capture first, for a quick preview
+preview = os.environ.get('NIR_PREVIEW', '1') != '0'
+preview_prefix = 'preview_'
+# archive the captures are appended to, if set
+archive_file = os.environ.get('NIR_ARCHIVE')
+# worker ('host[:port]', see offload.py) registration and the operations are
+# offloaded to when it is faster, if set
+offload_address = os.environ.get('NIR_OFFLOAD')
+# image file returned by the camera stand-in instead of the camera, for testing
+camera_file = os.environ.get('NIR_CAMERA_FILE')
 
 def sigint_handler(signal, frame):
     print('You pressed Ctrl+C!')
     sys.exit(0)
 
-# image capture stub
-def capture(capture_time, filename):
-    while time.time() < capture_time:
-        pass
+def open_camera():
+    if camera_file is not None:
+        return rawframe.FileCamera(camera_file)
+    return picamera.PiCamera()
+
+# image capture stub, output is a JPEG file (or file-like object) or a raw
+# rawframe.FrameBuffer
+def capture(capture_time, output):
+    with tracing.span('wait for capture time', 'capture', capture_time=capture_time):
+        while time.time() < capture_time:
+            pass
 
     print 'Capturing image at time', time.time()
 
-    with picamera.PiCamera() as camera:
-        camera.resolution = (camera_resolution_horizontal, camera_resolution_horizontal)
-        camera.start_preview()
-        time.sleep(2)
-        camera.capture(filename, 'jpeg')
-        camera.stop_preview()
+    with tracing.span('capture', 'capture'):
+        with open_camera() as camera:
+            camera.resolution = (camera_resolution_horizontal, camera_resolution_horizontal)
+            camera.start_preview()
+            time.sleep(2)
+            if isinstance(output, rawframe.FrameBuffer):
+                rawframe.capture(camera, output)
+            else:
+                camera.capture(output, 'jpeg')
+            camera.stop_preview()
 
     return
 
-def get_images():
+def get_images(raw_buffers=None):
+    # returns the encoded (nir, rgb) images, kept in memory, or captures the
+    # raw frames into the (nir, rgb) raw_buffers and returns them, followed
+    # by the capture time
+    if raw_buffers is None:
+        nir = io.BytesIO()
+        rgb = io.BytesIO()
+    else:
+        nir, rgb = raw_buffers
+
     # connect to server (who has the rgb camera)
     sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
     sock.connect((host, port))
@@ -59,57 +112,234 @@ def get_images():
         # image capture time (in future)
         capture_time = time.time() + 1.0
 
-        # sending capture time to server
-        sock.sendall(repr(capture_time))
+        # sending capture time and format to server
+        sock.sendall('%r %s' % (capture_time, capture_format))
 
         # capture local image (in future as well)
-        capture(capture_time, nir_image_file)
+        capture(capture_time, nir)
 
         print 'Receiving image data from server...'
-        f = open(rgb_image_file, 'wb')
-        data = sock.recv(4096)
-        while len(data) > 0:
-            f.write(data)
-            data = sock.recv(4096)
+        with tracing.span('receive', 'transfer'):
+            if raw_buffers is not None:
+                # the raw frame is received straight into its buffer
+                rgb = rawframe.receive(sock, rgb)
+            else:
+                data = sock.recv(4096)
+                while len(data) > 0:
+                    rgb.write(data)
+                    data = sock.recv(4096)
 
         print 'Done receiving image.'
 
     finally:
         sock.close()
 
-def normalize(src_image_file, dst_image_file):
-    grayscale = cv2.imread(src_image_file, 0)
+    if raw_buffers is not None:
+        return nir, rgb, capture_time
+    return nir.getvalue(), rgb.getvalue(), capture_time
+
+def get_mosaic(raw_buffers):
+    # captures the raw mosaic of the RGB-NIR sensor into the raw_buffers and
+    # returns it, followed by the capture time: both images come from the
+    # local camera, no server is involved
+    mosaic_buffer, = raw_buffers
+    capture_time = time.time()
+    capture(capture_time, mosaic_buffer)
+    return mosaic_buffer, capture_time
+
+# raw frame buffers not used by a capture being processed
+free_raw_buffers = []
+
+def take_raw_buffers():
+    # (nir, rgb) raw frame buffers, or the (mosaic,) buffer of the RGB-NIR
+    # sensor, preallocated once and reused when the processing of the capture
+    # using them is finished
+    if free_raw_buffers:
+        return free_raw_buffers.pop()
+    if capture_format == 'rgbn':
+        return (rawframe.FrameBuffer(camera_resolution_horizontal, camera_resolution_horizontal, rawframe.FORMAT_RGBN, rgbn_bits),)
+    return (rawframe.FrameBuffer(camera_resolution_horizontal, camera_resolution_horizontal, rawframe.FORMAT_YUV420),
+            rawframe.FrameBuffer(camera_resolution_horizontal, camera_resolution_horizontal, rawframe.FORMAT_BGR))
+
+def raw_sources(raw_buffers):
+    # the nir image is the luma plane of the yuv frame
+    if len(raw_buffers) == 1:
+        mosaic_buffer, = raw_buffers
+        return {stages.rgbn_mosaic: mosaic_buffer.pixels(), stages.rgbn_raw: mosaic_buffer.frame()}
+    nir, rgb = raw_buffers
+    return {stages.nir: nir.pixels(), stages.rgb: rgb.pixels(),
+            stages.nir_raw: nir.frame(), stages.rgb_raw: rgb.frame()}
 
-    hist, bins = numpy.histogram(grayscale.flatten(), 256, [0, 256])
-    cdf = hist.cumsum()
+def parse_pan_tilt_output(output):
+    # pan-tilt prints the operation followed by the pan and tilt servo pulse
+    # widths
+    fields = output.split()
+    pose = (int(fields[1]), int(fields[2])) if len(fields) >= 3 else (0, 0)
+    return (fields[0] if fields else ''), pose
 
-    cdf_m = numpy.ma.masked_equal(cdf,0)
-    cdf_m = (cdf_m - cdf_m.min())*255/(cdf_m.max()-cdf_m.min())
-    cdf = numpy.ma.filled(cdf_m,0).astype('uint8')
+def parse_sweep_output(line):
+    # pan-tilt --sweep acknowledges every move with the pose reached
+    fields = line.split()
+    return (int(fields[1]), int(fields[2])) if len(fields) >= 3 and fields[0] == 'POSE' else (0, 0)
 
-    dst = cdf[grayscale]
-    cv2.imwrite(dst_image_file, dst)
+def indexed_file(filename, captures):
+    # name of the output file of each capture when there are several of them
+    if captures == 1:
+        return filename
+    base, extension = os.path.splitext(filename)
+    return base + '_%03d' + extension
 
 # register signal handler
 signal.signal(signal.SIGINT, sigint_handler)
 
-# start pan-tilt subprocess and wait for completion
-pan_tilt_stdout, pan_tilt_stderr = subprocess.Popen(["/home/alarm/pan-tilt"], stdout=subprocess.PIPE).communicate()
-print "operation requested = " + pan_tilt_stdout
+# number of consecutive captures, processed in a pipeline so that a capture
+# is processed while the next one is registered and the one after is taken
+# ('sweep' captures every pose of a panorama sweep and builds its mosaics)
+sweep = len(sys.argv) > 1 and sys.argv[1] == 'sweep'
+sweep_poses = mosaic.sweep_poses() if sweep else []
+captures = len(sweep_poses) if sweep else int(sys.argv[1]) if len(sys.argv) > 1 else 1
+
+# images are exchanged in memory between the stages, files are only written
+# by the sink nodes
+g = stages.build_graph(preview=preview, raw=capture_format == 'raw', rgbn=capture_format == 'rgbn')
+if capture_format == 'rgbn':
+    capture_targets = [stages.add_file_sink(g, stages.rgbn_raw, indexed_file(rgbn_raw_file, captures))]
+elif capture_format == 'raw':
+    capture_targets = [
+        stages.add_file_sink(g, stages.nir_raw, indexed_file(nir_raw_file, captures)),
+        stages.add_file_sink(g, stages.rgb_raw, indexed_file(rgb_raw_file, captures)),
+    ]
+else:
+    capture_targets = [
+        stages.add_file_sink(g, stages.nir_jpeg, indexed_file(nir_image_file, captures)),
+        stages.add_file_sink(g, stages.rgb_jpeg, indexed_file(rgb_image_file, captures)),
+    ]
+common_targets = capture_targets + [
+    stages.add_file_sink(g, stages.nir_registered, indexed_file(nir_registered_image_file, captures)),
+]
+if archive_file is not None and capture_format == 'rgbn':
+    print 'The captures of the RGB-NIR sensor are not archived'
+elif archive_file is not None:
+    common_targets.append(stages.add_archive_sink(g, archive.Writer(archive_file), capture_format == 'raw'))
+operation_targets = {
+    op_skin_smoothing: [stages.add_file_sink(g, stages.skin_smoothing, indexed_file(skin_smoothing_image_file, captures))],
+    op_shadow_detection: [stages.add_file_sink(g, stages.shadow_detection_mask, indexed_file(shadow_detection_image_file, captures))],
+    op_dehazing: [stages.add_file_sink(g, stages.dehazing_image, indexed_file(dehazing_image_file, captures))],
+}
+# every operation, run concurrently from the same registered images
+operation_targets[op_all] = [target for targets in operation_targets.values() for target in targets]
+
+# preview of every operation, and the coarse homography warm starting the
+# full resolution registration
+preview_targets = {}
+if preview:
+    scale = stages.preview_scale
+    coarse = [stages.scaled(stages.homography, scale),
+              stages.add_file_sink(g, stages.scaled(stages.nir_registered, scale), indexed_file(preview_prefix + nir_registered_image_file, captures))]
+    preview_targets = {
+        op_skin_smoothing: coarse + [stages.add_file_sink(g, stages.scaled(stages.skin_smoothing, scale), indexed_file(preview_prefix + skin_smoothing_image_file, captures))],
+        op_shadow_detection: coarse + [stages.add_file_sink(g, stages.scaled(stages.shadow_detection_mask, scale), indexed_file(preview_prefix + shadow_detection_image_file, captures))],
+        op_dehazing: coarse + [stages.add_file_sink(g, stages.scaled(stages.dehazing_image, scale), indexed_file(preview_prefix + dehazing_image_file, captures))],
+    }
+    preview_targets[op_all] = coarse + [t for targets in preview_targets.values() for t in targets if t not in coarse]
+
+offloader = offload.Offloader(offload_address, capture_format == 'raw', preview, capture_format == 'rgbn') if offload_address else None
+processing = pipeline.Pipeline(stages.pipeline_stages(g, preview, offloader))
+
+# layers of the mosaic of a sweep, all in the coordinates of the rgb image
+mosaic_layers = [stages.rgb, stages.nir_registered, stages.skin_smoothing, stages.shadow_detection_mask]
+panorama = mosaic.Mosaic(mosaic.center_pose(sweep_poses)) if sweep else None
+
+def start_sweep():
+    # pan-tilt driven from its stdin for the whole sweep
+    env = dict(os.environ)
+    if tracing.enabled:
+        env['PAN_TILT_TRACE'] = pan_tilt_trace_file
+    return subprocess.Popen(["/home/alarm/pan-tilt", "--sweep"], stdin=subprocess.PIPE, stdout=subprocess.PIPE, env=env)
+
+def produce():
+    pan_tilt = start_sweep() if sweep else None
+    for index in range(captures):
+        if sweep:
+            # move to the next pose of the sweep and wait for it to settle
+            with tracing.span('pan-tilt', 'control', capture=index):
+                pan_tilt.stdin.write('MOVE %d %d\n' % sweep_poses[index])
+                pan_tilt.stdin.flush()
+                pose = parse_sweep_output(pan_tilt.stdout.readline())
+            operation = op_all
+            print 'sweep pose %d of %d = %d %d' % (index + 1, captures, pose[0], pose[1])
+        else:
+            # start pan-tilt subprocess and wait for completion
+            env = dict(os.environ)
+            if tracing.enabled:
+                env['PAN_TILT_TRACE'] = pan_tilt_trace_file
+            with tracing.span('pan-tilt', 'control', capture=index):
+                pan_tilt_stdout, pan_tilt_stderr = subprocess.Popen(["/home/alarm/pan-tilt"], stdout=subprocess.PIPE, env=env).communicate()
+            operation, pose = parse_pan_tilt_output(pan_tilt_stdout)
+            print "operation requested = " + operation
+            if tracing.enabled:
+                tracing.load(pan_tilt_trace_file)
+
+        targets = common_targets + operation_targets.get(operation, [])
+        if sweep:
+            targets = targets + mosaic_layers
+        if capture_format == 'rgbn':
+            with tracing.span('get images', 'capture', capture=index):
+                mosaic_raw, capture_time = get_mosaic(take_raw_buffers())
+            raw_buffers = (mosaic_raw,)
+            sources = raw_sources(raw_buffers)
+        elif capture_format == 'raw':
+            with tracing.span('get images', 'capture', capture=index):
+                nir_raw, rgb_raw, capture_time = get_images(take_raw_buffers())
+            raw_buffers = (nir_raw, rgb_raw)
+            sources = raw_sources(raw_buffers)
+        else:
+            with tracing.span('get images', 'capture', capture=index):
+                nir_jpeg, rgb_jpeg, capture_time = get_images()
+            sources = {stages.nir_jpeg: nir_jpeg, stages.rgb_jpeg: rgb_jpeg}
+        sources.update({stages.capture_index: index, stages.capture_time: capture_time,
+                        stages.pose: pose, stages.operation: operation})
+        job = pipeline.Job(index, sources, targets, preview_targets.get(operation, []))
+        if capture_format != 'jpeg':
+            job.on_release.append(lambda buffers=raw_buffers: free_raw_buffers.append(buffers))
+        processing.submit(job)
 
-get_images()
+    if pan_tilt is not None:
+        pan_tilt.communicate('END\n')
+        if tracing.enabled:
+            tracing.load(pan_tilt_trace_file)
+    processing.close()
 
-# convert nir image to grayscale
-normalize(nir_image_file, nir_normalized_image_file)
+producer = threading.Thread(target=produce)
+producer.daemon = True
+producer.start()
 
-# registration
-nir_registered = registration.register(nir_normalized_image_file, rgb_image_file)
-cv2.imwrite(nir_registered_image_file, nir_registered)
+for job in processing.results():
+    if job.error is not None:
+        print 'Capture %d failed in stage %s: %s' % (job.index, job.error[0], job.error[1])
+    preview_latency, final_latency = job.latencies()
+    if preview_latency is not None:
+        print 'Capture %d: preview ready after %.3f s%s, final result after %.3f s' % (
+            job.index, preview_latency, ' (over budget)' if preview_latency > stages.preview_budget else '', final_latency)
+    else:
+        print 'Capture %d: final result after %.3f s' % (job.index, final_latency)
+    if panorama is not None and job.error is None:
+        # the frames are copied, their buffers go back to the pools
+        layers = dict((name, mosaic.detach(job.frames[name].data)) for name in mosaic_layers)
+        with tracing.span('mosaic', 'processing', capture=job.index):
+            panorama.add(job.sources[stages.pose], layers[stages.rgb], layers)
+    job.release()
 
-if pan_tilt_stdout == op_skin_smoothing:
-    final_image = merging.merge(rgb_image_file, nir_registered_image_file)
-    cv2.imwrite(skin_smoothing_image_file, final_image)
+if panorama is not None and panorama.captures:
+    if not os.path.isdir(mosaic_directory):
+        os.makedirs(mosaic_directory)
+    for name in mosaic_layers:
+        with tracing.span('mosaic tiles', 'processing', layer=name):
+            index = panorama.write_tiles(name, mosaic_directory)
+        print 'Mosaic %s: %d x %d in %d tiles' % (name, index['width'], index['height'], len(index['tiles']))
 
-elif pan_tilt_stdout == op_shadow_detection:
-    final_image = shadow_detection.shadowDetection(rgb_image_file, nir_registered_image_file)
-    scipy.misc.imsave(shadow_detection_image_file, final_image)
+g.print_timings()
+processing.print_stats()
+if offloader is not None:
+    offloader.print_stats()
+tracing.export()
@@ -1,11 +1,19 @@
 #!/usr/bin/python2
 
-import picamera
+import os
 import signal
 import socket
 import sys
 import time
 
+import rawframe
+import tracing
+
+try:
+    import picamera
+except ImportError:
+    picamera = None
+
 # constants
 master = '192.168.1.13'
 slave = '192.168.1.14'
@@ -15,23 +23,39 @@ camera_resolution_horizontal = 640
 camera_resolution_vertical = 480
 rgb_image_file = 'rgb.jpg'
 
+# image file returned by the camera stand-in instead of the camera, for testing
+camera_file = os.environ.get('NIR_CAMERA_FILE')
+
+# raw frames are captured into this preallocated buffer
+rgb_raw_buffer = None
+
 def sigint_handler(signal, frame):
     print('You pressed Ctrl+C!')
     sys.exit(0)
 
-# image capture stub
-def capture(capture_time, filename):
-    while time.time() < capture_time:
-        pass
+def open_camera():
+    if camera_file is not None:
+        return rawframe.FileCamera(camera_file)
+    return picamera.PiCamera()
+
+# image capture stub, output is a JPEG file name or a rawframe.FrameBuffer
+def capture(capture_time, output):
+    with tracing.span('wait for capture time', 'capture', capture_time=capture_time):
+        while time.time() < capture_time:
+            pass
 
     print 'Capturing image at time', time.time()
 
-    with picamera.PiCamera() as camera:
-        camera.resolution = (camera_resolution_horizontal, camera_resolution_horizontal)
-        camera.start_preview()
-        time.sleep(2)
-        camera.capture(filename, 'jpeg')
-        camera.stop_preview()
+    with tracing.span('capture', 'capture'):
+        with open_camera() as camera:
+            camera.resolution = (camera_resolution_horizontal, camera_resolution_horizontal)
+            camera.start_preview()
+            time.sleep(2)
+            if isinstance(output, rawframe.FrameBuffer):
+                rawframe.capture(camera, output)
+            else:
+                camera.capture(output, 'jpeg')
+            camera.stop_preview()
 
     return
 
@@ -53,21 +77,38 @@ while True:
         print 'Accepted connection from', addr
 
         while True:
-            # receive image capture time (in future) from client
-            capture_time = float(conn.recv(256))
+            # receive image capture time (in future) and format from client
+            request = conn.recv(256).split()
+            capture_time = float(request[0])
+            capture_format = request[1] if len(request) > 1 else 'jpeg'
             print 'Capture time received from client:', capture_time
+            tracing.instant('capture time received', 'capture', capture_time=capture_time)
+
+            if capture_format == 'raw':
+                # capture local image (in future) into the preallocated buffer
+                if rgb_raw_buffer is None:
+                    rgb_raw_buffer = rawframe.FrameBuffer(camera_resolution_horizontal, camera_resolution_horizontal, rawframe.FORMAT_BGR)
+                capture(capture_time, rgb_raw_buffer)
+
+                print 'Sending image data to client...'
+                with tracing.span('send', 'transfer'):
+                    rawframe.send(conn, rgb_raw_buffer.frame())
+                print 'Done sending image.'
+                break
 
             # capture local image (in future)
             capture(capture_time, rgb_image_file)
 
             print 'Sending image data to client...'
-            f = open(rgb_image_file, 'rb')
-            data = f.read(4096)
-            while data:
-                conn.send(data)
+            with tracing.span('send', 'transfer'):
+                f = open(rgb_image_file, 'rb')
                 data = f.read(4096)
+                while data:
+                    conn.send(data)
+                    data = f.read(4096)
             print 'Done sending image.'
             break
 
     finally:
         conn.close()
+        tracing.export()
@@ -0,0 +1,110 @@
+#!/usr/bin/python2
+
+"""
+Camera unit of a capture cluster (cluster.py): registers with the
+coordinator under a name, then captures a frame at every capture time the
+coordinator broadcasts and sends it back. The camera is kept open between
+the captures, so that a capture starts at the capture time.
+
+    ./camera_unit.py NAME [--coordinator HOST] [--port PORT]
+
+NIR_CAMERA_FILE replaces the camera by an image file, e.g. to run the units
+as local processes.
+"""
+
+import argparse
+import io
+import os
+import socket
+import time
+
+import cluster
+import rawframe
+import tracing
+
+try:
+    import picamera
+except ImportError:
+    picamera = None
+
+# constants
+master = '192.168.1.13'
+camera_resolution_horizontal = 640
+camera_resolution_vertical = 480
+
+# image file returned by the camera stand-in instead of the camera, for testing
+camera_file = os.environ.get('NIR_CAMERA_FILE')
+
+def open_camera():
+    if camera_file is not None:
+        return rawframe.FileCamera(camera_file)
+    return picamera.PiCamera()
+
+def capture(camera, capture_time, output):
+    # captures into output (a file-like object or a raw rawframe.FrameBuffer)
+    # at capture_time, and returns the time the capture started
+    with tracing.span('wait for capture time', 'capture', capture_time=capture_time):
+        while time.time() < capture_time:
+            pass
+
+    start = time.time()
+    with tracing.span('capture', 'capture'):
+        if isinstance(output, rawframe.FrameBuffer):
+            rawframe.capture(camera, output)
+        else:
+            camera.capture(output, 'jpeg')
+    return start
+
+def main():
+    parser = argparse.ArgumentParser(description='Camera unit of a capture cluster.')
+    parser.add_argument('name')
+    parser.add_argument('--coordinator', default=master)
+    parser.add_argument('--port', type=int, default=cluster.port)
+    args = parser.parse_args()
+
+    # raw frames are captured into this preallocated buffer
+    raw_buffer = None
+
+    sock = socket.create_connection((args.coordinator, args.port))
+    sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+    camera = open_camera()
+    try:
+        camera.resolution = (camera_resolution_horizontal, camera_resolution_horizontal)
+        camera.start_preview()
+        # warm up (exposure and white balance) once, not at every capture
+        time.sleep(2)
+
+        cluster.send_message(sock, cluster.MSG_HELLO, {'name': args.name})
+        while True:
+            try:
+                type, meta, _ = cluster.receive_message(sock)
+            except IOError:
+                break
+            if type == cluster.MSG_BYE:
+                break
+            if type != cluster.MSG_CAPTURE:
+                continue
+
+            tracing.instant('capture time received', 'capture', capture_time=meta['capture_time'])
+            if meta['format'] == 'raw':
+                if raw_buffer is None:
+                    raw_buffer = rawframe.FrameBuffer(camera_resolution_horizontal, camera_resolution_horizontal, rawframe.FORMAT_BGR)
+                capture_time = capture(camera, meta['capture_time'], raw_buffer)
+                payload = raw_buffer.frame()
+            else:
+                output = io.BytesIO()
+                capture_time = capture(camera, meta['capture_time'], output)
+                payload = output.getvalue()
+
+            with tracing.span('send', 'transfer'):
+                cluster.send_message(sock, cluster.MSG_FRAME, {'index': meta['index'], 'capture_time': capture_time,
+                                                               'format': meta['format']}, payload)
+    finally:
+        camera.stop_preview()
+        if hasattr(camera, 'close'):
+            camera.close()
+        sock.close()
+        tracing.export()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,416 @@
+#!/usr/bin/python2
+
+"""
+Capture cluster: one coordinator triggering any number of camera units
+(camera_unit.py), e.g. NIR units with filters of different cut-offs and a
+second RGB unit for stereo.
+
+The units connect to the coordinator and register under a name. For every
+capture, the coordinator broadcasts one capture time to all of them, and
+receives their frames concurrently in a single epoll event loop, straight
+into a buffer of the frame size. The clocks of the units are kept
+synchronized by ptpd (see tracing.py), so the capture time reported by every
+unit gives its sync skew, the difference with the requested capture time.
+
+Messages are framed: a fixed header (magic, type, metadata size, payload
+size), a JSON metadata block and the payload (an encoded image or a raw
+frame, rawframe.py).
+
+    ./cluster.py [--units N | --units nir,rgb,nir720] [--captures 3] [--format raw]
+
+spawns the units as local processes on the loopback interface (with the
+camera stand-in), triggers the captures and prints the skew and transfer
+time of every unit. With --wait N, no unit is spawned and the coordinator
+waits for N units to connect, e.g. on the Pis of the cluster.
+"""
+
+import argparse
+import errno
+import json
+import os
+import select
+import socket
+import struct
+import subprocess
+import sys
+import time
+
+import rawframe
+import tracing
+
+# constants
+port = 1314
+# delay between the capture trigger and the capture time, leaving the time
+# for the trigger to reach every unit
+capture_delay = 0.5
+# time given to the units to deliver their frames
+collect_timeout = 10.0
+
+magic = b'NIRC'
+# message types
+MSG_HELLO = 1    # unit -> coordinator: {'name': ...}
+MSG_CAPTURE = 2  # coordinator -> units: {'index': ..., 'capture_time': ..., 'format': ...}
+MSG_FRAME = 3    # unit -> coordinator: {'index': ..., 'capture_time': ..., 'format': ...} + image
+MSG_BYE = 4      # coordinator -> units: the unit exits
+
+# message header: magic, type, metadata size, payload size
+header_struct = struct.Struct('<4sBxxxIQ')
+header_size = header_struct.size
+
+def pack_message(type, meta, payload_size=0):
+    # header and metadata of a message
+    data = json.dumps(meta).encode('utf-8')
+    return header_struct.pack(magic, type, len(data), payload_size) + data
+
+def send_message(sock, type, meta, payload=None):
+    # sends a message on a blocking socket, the payload (bytes or a raw
+    # frame, sent from its buffer) without copying it
+    if isinstance(payload, rawframe.RawFrame):
+        sock.sendall(pack_message(type, meta, rawframe.frame_size(payload)))
+        rawframe.send(sock, payload)
+        return
+    size = len(payload) if payload is not None else 0
+    sock.sendall(pack_message(type, meta, size))
+    if size:
+        sock.sendall(payload)
+
+def receive_exactly(sock, size):
+    data = bytearray(size)
+    rawframe.receive_exactly(sock, memoryview(data))
+    return data
+
+def receive_message(sock):
+    # (type, meta, payload) of the next message on a blocking socket
+    header = receive_exactly(sock, header_size)
+    message_magic, type, meta_size, payload_size = header_struct.unpack(bytes(header))
+    if message_magic != magic:
+        raise IOError('not a cluster message')
+    meta = json.loads(bytes(receive_exactly(sock, meta_size)).decode('utf-8'))
+    return type, meta, receive_exactly(sock, payload_size)
+
+
+class Frame(object):
+    """
+    Frame of a unit for a capture, with its timing: skew is the capture time
+    reported by the unit minus the requested capture time, transfer_time the
+    time from the first to the last byte of the frame received.
+    """
+
+    def __init__(self, name, meta, data, requested_time, first_byte_time, last_byte_time):
+        self.name = name
+        self.index = meta['index']
+        self.meta = meta
+        self.data = data
+        self.capture_time = meta['capture_time']
+        self.skew = self.capture_time - requested_time
+        self.first_byte_time = first_byte_time
+        self.last_byte_time = last_byte_time
+        self.transfer_time = last_byte_time - first_byte_time
+
+    def is_raw(self):
+        return rawframe.is_raw_frame(self.data)
+
+    def image(self):
+        # the raw frame (received in place) or the encoded image
+        if self.is_raw():
+            return rawframe.from_buffer(self.data)
+        return bytes(self.data)
+
+
+class Connection(object):
+    """
+    Non-blocking connection of a unit. Incoming messages are received
+    stage by stage (header, metadata, payload) into buffers of their exact
+    size, as data arrives; outgoing messages are queued until the socket
+    accepts them.
+    """
+
+    def __init__(self, sock, address):
+        self.sock = sock
+        self.address = address
+        self.name = None
+        self.outgoing = b''
+        self.expect(header_size, 'header')
+
+    def expect(self, size, stage):
+        self.stage = stage
+        self.buffer = bytearray(size)
+        self.received = 0
+
+    def receive(self):
+        """
+        Reads what the socket has, and returns the completed message as
+        (type, meta, payload, first byte time, last byte time), or None if
+        it needs more data. Raises IOError when the unit disconnects.
+        """
+        while True:
+            if self.received == len(self.buffer):
+                message = self.advance()
+                if message is not None:
+                    return message
+                continue
+            try:
+                count = self.sock.recv_into(memoryview(self.buffer)[self.received:])
+            except socket.error as e:
+                if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+                    return None
+                raise IOError('connection of %s failed: %s' % (self.name, e))
+            if count == 0:
+                raise IOError('%s disconnected' % self.name)
+            if self.stage == 'header' and self.received == 0:
+                self.first_byte_time = time.time()
+            self.received += count
+
+    def advance(self):
+        # moves to the next stage once the current buffer is full
+        if self.stage == 'header':
+            message_magic, self.type, meta_size, self.payload_size = header_struct.unpack(bytes(self.buffer))
+            if message_magic != magic:
+                raise IOError('%s sent a message with a bad magic' % self.address[0])
+            self.expect(meta_size, 'meta')
+            return None
+        if self.stage == 'meta':
+            self.meta = json.loads(bytes(self.buffer).decode('utf-8'))
+            self.expect(self.payload_size, 'payload')
+            return None
+        message = (self.type, self.meta, self.buffer, self.first_byte_time, time.time())
+        self.expect(header_size, 'header')
+        return message
+
+    def queue(self, data):
+        self.outgoing += data
+
+    def flush(self):
+        # sends what the socket accepts, returns True if everything was sent
+        while self.outgoing:
+            try:
+                count = self.sock.send(self.outgoing)
+            except socket.error as e:
+                if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+                    return False
+                raise IOError('connection of %s failed: %s' % (self.name, e))
+            self.outgoing = self.outgoing[count:]
+        return True
+
+
+class Coordinator(object):
+    """
+    Triggers the captures of the registered units and collects their frames.
+    Everything (accepting units, broadcasting triggers, receiving frames)
+    runs in one epoll loop, driven by poll().
+    """
+
+    def __init__(self, host='', port=port):
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind((host, port))
+        self.listener.listen(16)
+        self.listener.setblocking(False)
+        self.epoll = select.epoll()
+        self.epoll.register(self.listener.fileno(), select.EPOLLIN)
+        self.connections = {}  # fd -> Connection
+        self.units = {}        # name -> Connection
+        self.frames = {}       # (index, name) -> Frame
+        self.requested = {}    # index -> requested capture time
+        self.index = 0
+
+    def accept(self):
+        while True:
+            try:
+                sock, address = self.listener.accept()
+            except socket.error as e:
+                if e.errno in (errno.EAGAIN, errno.EWOULDBLOCK):
+                    return
+                raise
+            sock.setblocking(False)
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            self.connections[sock.fileno()] = Connection(sock, address)
+            self.epoll.register(sock.fileno(), select.EPOLLIN)
+
+    def drop(self, connection, reason):
+        print('Unit %s dropped: %s' % (connection.name or connection.address[0], reason))
+        fd = connection.sock.fileno()
+        self.epoll.unregister(fd)
+        connection.sock.close()
+        del self.connections[fd]
+        if connection.name is not None and self.units.get(connection.name) is connection:
+            del self.units[connection.name]
+
+    def handle(self, connection, message):
+        type, meta, payload, first_byte_time, last_byte_time = message
+        if type == MSG_HELLO:
+            name = meta['name']
+            if name in self.units:
+                # the unit reconnected, its old connection is stale
+                self.drop(self.units[name], 'replaced by a new connection')
+            connection.name = name
+            self.units[name] = connection
+            print('Unit %s registered from %s' % (name, connection.address[0]))
+        elif type == MSG_FRAME:
+            requested_time = self.requested.get(meta['index'], meta['capture_time'])
+            self.frames[(meta['index'], connection.name)] = Frame(connection.name, meta, payload, requested_time,
+                                                                  first_byte_time, last_byte_time)
+            tracing.instant('frame received', 'transfer', unit=connection.name, index=meta['index'])
+
+    def poll(self, timeout):
+        for fd, events in self.epoll.poll(timeout):
+            if fd == self.listener.fileno():
+                self.accept()
+                continue
+            connection = self.connections.get(fd)
+            if connection is None:
+                continue
+            try:
+                if events & (select.EPOLLIN | select.EPOLLHUP | select.EPOLLERR):
+                    while True:
+                        message = connection.receive()
+                        if message is None:
+                            break
+                        self.handle(connection, message)
+                if events & select.EPOLLOUT and connection.flush():
+                    self.epoll.modify(fd, select.EPOLLIN)
+            except IOError as e:
+                self.drop(connection, e)
+
+    def wait_for_units(self, count, timeout=None):
+        # runs the loop until count units are registered, returns their names
+        deadline = time.time() + timeout if timeout is not None else None
+        while len(self.units) < count:
+            remaining = deadline - time.time() if deadline is not None else -1
+            if deadline is not None and remaining <= 0:
+                break
+            self.poll(remaining)
+        return sorted(self.units)
+
+    def broadcast(self, type, meta):
+        data = pack_message(type, meta)
+        for connection in list(self.units.values()):
+            connection.queue(data)
+            try:
+                if not connection.flush():
+                    self.epoll.modify(connection.sock.fileno(), select.EPOLLIN | select.EPOLLOUT)
+            except IOError as e:
+                self.drop(connection, e)
+
+    def trigger(self, format='jpeg', delay=capture_delay):
+        """
+        Broadcasts the next capture to every registered unit, to be taken
+        delay seconds from now, and returns its index and the units
+        triggered.
+        """
+        self.index += 1
+        capture_time = time.time() + delay
+        self.requested[self.index] = capture_time
+        units = sorted(self.units)
+        with tracing.span('trigger', 'capture', index=self.index, capture_time=capture_time):
+            self.broadcast(MSG_CAPTURE, {'index': self.index, 'capture_time': capture_time, 'format': format})
+        return self.index, units
+
+    def collect(self, index, units, timeout=collect_timeout):
+        """
+        Runs the loop until the frames of capture index from all the units
+        are received (or timeout), and returns them as a name -> Frame
+        dictionary. Units that disconnected or timed out are missing.
+        """
+        deadline = time.time() + timeout
+        pending = set(units)
+        frames = {}
+        while True:
+            for name in list(pending):
+                frame = self.frames.pop((index, name), None)
+                if frame is not None:
+                    frames[name] = frame
+                    pending.discard(name)
+                elif name not in self.units:
+                    pending.discard(name)
+            remaining = deadline - time.time()
+            if not pending or remaining <= 0:
+                break
+            self.poll(remaining)
+        self.requested.pop(index, None)
+        return frames
+
+    def capture(self, format='jpeg', delay=capture_delay, timeout=collect_timeout):
+        # triggers a capture and returns (index, units triggered, frames)
+        index, units = self.trigger(format, delay)
+        return index, units, self.collect(index, units, timeout)
+
+    def close(self):
+        self.broadcast(MSG_BYE, {})
+        for connection in list(self.connections.values()):
+            connection.flush()
+            self.epoll.unregister(connection.sock.fileno())
+            connection.sock.close()
+        self.connections = {}
+        self.units = {}
+        self.epoll.close()
+        self.listener.close()
+
+
+def print_report(index, units, frames):
+    # per unit sync skew and transfer time of a capture
+    print('Capture %d:' % index)
+    for name in units:
+        frame = frames.get(name)
+        if frame is None:
+            print('  %-12s missing' % name)
+            continue
+        size = len(frame.data)
+        print('  %-12s skew %+8.3f ms  transfer %8.3f ms  %8.1f kB  %8.1f MB/s'
+              % (name, frame.skew * 1000, frame.transfer_time * 1000, size / 1024.0,
+                 size / frame.transfer_time / 1048576.0 if frame.transfer_time > 0 else 0.0))
+    if frames:
+        times = [frame.capture_time for frame in frames.values()]
+        last = max(frame.last_byte_time for frame in frames.values())
+        print('  spread %.3f ms, all frames received %.3f ms after the capture time'
+              % ((max(times) - min(times)) * 1000, (last - max(times)) * 1000))
+
+def spawn_units(names, port, camera_file):
+    # starts the units as local processes connecting on the loopback interface
+    environment = dict(os.environ)
+    if camera_file is not None:
+        environment['NIR_CAMERA_FILE'] = camera_file
+    unit = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'camera_unit.py')
+    return [subprocess.Popen([sys.executable, unit, name, '--coordinator', '127.0.0.1', '--port', str(port)],
+                             env=environment)
+            for name in names]
+
+def main():
+    default_camera_file = os.path.join(os.path.dirname(os.path.dirname(os.path.abspath(__file__))),
+                                       'skin_smoothing_photos', 'd15_sigmac10_sigmas5', 'rgb.jpg')
+    parser = argparse.ArgumentParser(description='Trigger synchronized captures on a cluster of camera units.')
+    parser.add_argument('--units', default='2', help='number of local units to spawn, or their names separated by commas (default: %(default)s)')
+    parser.add_argument('--wait', type=int, help='wait for this number of units to connect instead of spawning them')
+    parser.add_argument('--captures', type=int, default=3)
+    parser.add_argument('--format', default='jpeg', choices=['jpeg', 'raw'])
+    parser.add_argument('--port', type=int, default=port)
+    parser.add_argument('--delay', type=float, default=capture_delay, help='delay between the trigger and the capture time (s)')
+    parser.add_argument('--camera-file', default=os.environ.get('NIR_CAMERA_FILE', default_camera_file),
+                        help='image returned by the camera stand-in of the spawned units')
+    args = parser.parse_args()
+
+    coordinator = Coordinator(port=args.port)
+    processes = []
+    try:
+        if args.wait is None:
+            names = args.units.split(',') if not args.units.isdigit() else ['unit%d' % i for i in range(int(args.units))]
+            processes = spawn_units(names, args.port, args.camera_file)
+            count = len(names)
+        else:
+            count = args.wait
+        print('Waiting for %d units...' % count)
+        units = coordinator.wait_for_units(count, timeout=30.0)
+        if len(units) < count:
+            print('Only %d of %d units registered' % (len(units), count))
+
+        for _ in range(args.captures):
+            index, units, frames = coordinator.capture(args.format, args.delay)
+            print_report(index, units, frames)
+    finally:
+        coordinator.close()
+        for process in processes:
+            process.wait()
+        tracing.export()
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,56 @@
+"""
+JPEG decoding at the resolution and with the channels a stage needs.
+
+libjpeg can run the inverse DCT at 1/2, 1/4 or 1/8 of the resolution, which
+skips most of the decoding work, and can decode the luma component only. PIL
+exposes both through Image.draft(). Stages declare what they need with a
+Request, and the frame is decoded once for it.
+"""
+
+import io
+
+import cv2
+import numpy
+from PIL import Image
+
+# scales supported by the libjpeg scaled inverse DCT
+scales = (1, 2, 4, 8)
+
+
+class Request(object):
+    """
+    What a stage needs from a JPEG image: channels is 1 (luma only) or 3
+    (BGR, as OpenCV) and scale the reduction factor (1, 2, 4 or 8).
+    """
+
+    def __init__(self, channels=3, scale=1):
+        if scale not in scales:
+            raise ValueError('unsupported decoding scale 1/%d' % scale)
+        self.channels = channels
+        self.scale = scale
+
+
+def decode(data, request):
+    """
+    Decodes the JPEG data as requested. Returns a uint8 array of
+    ceil(height / scale) x ceil(width / scale) pixels, with 3 channels in
+    BGR order or a single luma channel.
+    """
+    image = Image.open(io.BytesIO(data))
+    width, height = image.size
+    mode = 'L' if request.channels == 1 else 'RGB'
+
+    # let libjpeg scale the inverse DCT and skip the chroma components
+    image.draft(mode, ((width + request.scale - 1) // request.scale,
+                       (height + request.scale - 1) // request.scale))
+    if image.mode != mode:
+        image = image.convert(mode)
+
+    pixels = numpy.asarray(image)
+    if request.channels == 1:
+        return pixels
+    return cv2.cvtColor(pixels, cv2.COLOR_RGB2BGR)
+
+def decoder(request):
+    # graph node function decoding its input as requested
+    return lambda data: decode(data, request)
@@ -0,0 +1,189 @@
+"""
+NIR-guided dehazing. Haze scatters visible light much more than near
+infrared, so the nir image keeps the contrast the haze takes away from the
+visible one. With the haze model I = J t + A (1 - t), the visible image is
+locally a linear function of the nir one, I ~ a nir + b, whose slope a (the
+visible to nir contrast ratio) is reduced by the transmission t and whose
+offset b is the veil A (1 - t) the haze adds. The offset of the local linear
+model (the guided filter coefficients) thus gives the transmission, except
+where the scene itself isn't proportional to the nir image; the dark channel
+prior gives it except on bright surfaces. Both only underestimate the
+transmission where their assumption fails, so the larger of the two is kept.
+The transmission is then refined with the guided filter following the edges
+of the nir image, and the scene radiance J recovered.
+
+The airlight A is estimated first on a reduced image (estimate). Everything
+else is local, so the image is then processed in horizontal tiles in
+parallel, each with a margin covering the filter windows (the result doesn't
+depend on the tiling). Only the tiles are converted to float, and the tile
+height and the number of tiles processed at once are chosen so that the
+working memory of all the threads stays within memory_budget, e.g. for full
+resolution frames of the Raspberry Pi camera.
+"""
+
+import multiprocessing
+from multiprocessing.pool import ThreadPool
+
+import cv2
+import numpy
+
+import guided_filter
+import pixel
+
+# Radius and regularization of the local linear model of the visible image
+# on the nir one, and radius of the dark channel
+veil_radius = 16
+veil_eps = 1e-2
+dark_radius = 7
+# Fraction of the estimated haze removed (keeps some haze for the depth
+# impression and for the surfaces both priors mistake for haze), and lower
+# bound of the transmission (keeps the noise of dense haze from being
+# amplified)
+omega = 0.8
+min_transmission = 0.1
+# Fraction of the brightest pixels of the dark channel the airlight is
+# estimated from
+airlight_fraction = 0.001
+# Radius and regularization of the guided filter refining the transmission
+refine_radius = 16
+refine_eps = 1e-3
+# Reduction of the image the airlight is estimated on
+estimate_scale = 4
+
+# Number of tiles processed in parallel
+threads = multiprocessing.cpu_count()
+# Memory allocated by dehaze (the output image if not given, and all the
+# tiles processed at once), in bytes, and the number of float32 planes per
+# tile pixel alive at the same time (color tile, local statistics,
+# transmission, guided filter coefficients and their temporaries, as
+# measured)
+memory_budget = 256 * 1024 * 1024
+tile_planes = 16
+min_tile_rows = 32
+
+# Worker threads, created on first use
+pool = None
+
+def get_pool():
+    global pool
+    if pool is None:
+        pool = ThreadPool(threads)
+    return pool
+
+def parameters():
+    return dict((name, globals()[name]) for name in (
+        'veil_radius', 'veil_eps', 'dark_radius', 'omega', 'min_transmission',
+        'airlight_fraction', 'refine_radius', 'refine_eps'))
+
+def scaled_radius(radius, scale):
+    return max(1, int(round(radius / float(scale))))
+
+def local_minimum(image, radius):
+    # minimum over the (2 radius + 1)^2 window
+    kernel = cv2.getStructuringElement(cv2.MORPH_RECT, (2 * radius + 1, 2 * radius + 1))
+    return cv2.erode(image, kernel)
+
+def dark_channel(image, radius):
+    # minimum over the color channels and the (2 radius + 1)^2 window
+    return local_minimum(image.min(axis=2), radius)
+
+def estimate(rgb, scale=1):
+    """
+    Airlight of a hazy image (one value per color channel): the mean color
+    of the pixels with the brightest dark channel, on the image reduced by
+    estimate_scale. scale is the reduction of the image given (e.g. of a
+    preview), the radii being for full resolution images.
+    """
+    reduction = max(1, estimate_scale // scale)
+    size = ((rgb.shape[1] + reduction - 1) // reduction, (rgb.shape[0] + reduction - 1) // reduction)
+    small = pixel.to_float(cv2.resize(rgb, size, interpolation=cv2.INTER_AREA))
+
+    dark = dark_channel(small, scaled_radius(dark_radius, scale * reduction))
+    count = max(1, int(dark.size * airlight_fraction))
+    brightest = numpy.argpartition(dark.ravel(), dark.size - count)[-count:]
+    airlight = small.reshape(-1, 3)[brightest].mean(axis=0)
+    return numpy.maximum(airlight, 1e-3).astype(numpy.float32)
+
+def transmission(rgb, nir, airlight, scale=1):
+    # transmission of a float32 tile, before refinement. The minimum of the
+    # color channels normalized by the airlight is both what the veil is
+    # fitted on and the dark channel before the window minimum.
+    normalized = rgb[:, :, 0] / airlight[0]
+    for c in (1, 2):
+        numpy.minimum(normalized, rgb[:, :, c] / airlight[c], out=normalized)
+    _, veil = guided_filter.coefficients(nir, normalized, scaled_radius(veil_radius, scale), veil_eps)
+    numpy.minimum(veil, local_minimum(normalized, scaled_radius(dark_radius, scale)), out=veil)
+    veil *= -omega
+    veil += 1
+    return veil
+
+def margin(scale=1):
+    # rows around a tile its result depends on
+    return max(2 * scaled_radius(veil_radius, scale), scaled_radius(dark_radius, scale)) + 2 * scaled_radius(refine_radius, scale)
+
+def tiling(height, width, scale=1, reserved=0):
+    # rows of a tile and number of tiles processed at once, fitting what
+    # memory_budget leaves after the reserved bytes. Every tile recomputes
+    # its margins, so more tiles at once are not always faster: the number
+    # taking the least time for all the batches of tiles (in rows processed
+    # by a thread) is kept, which stops at tiles of about twice the margin
+    # when the memory is the limit.
+    tile_margin = margin(scale)
+    budget_rows = (memory_budget - reserved) // (width * tile_planes * 4)
+    best = None
+    for concurrent in range(1, threads + 1):
+        rows = max(min_tile_rows, min(budget_rows // concurrent - 2 * tile_margin, (height + concurrent - 1) // concurrent))
+        batches = ((height + rows - 1) // rows + concurrent - 1) // concurrent
+        cost = batches * (rows + 2 * tile_margin)
+        if best is None or cost < best[0]:
+            best = (cost, rows, concurrent)
+    return best[1], best[2]
+
+def dehaze_tile(rgb, nir, airlight, scale, top, bottom, dst):
+    """
+    Dehazes the rows [top, bottom) of rgb into dst, from the tile extended
+    by the margin of the filters.
+    """
+    extended_top = max(0, top - margin(scale))
+    extended_bottom = min(rgb.shape[0], bottom + margin(scale))
+    tile_rgb = pixel.to_float(rgb[extended_top:extended_bottom])
+    tile_nir = pixel.to_float(nir[extended_top:extended_bottom])
+
+    t = transmission(tile_rgb, tile_nir, airlight, scale)
+    t = guided_filter.guided_filter(tile_nir, t, scaled_radius(refine_radius, scale), refine_eps)
+    del tile_nir
+    numpy.maximum(t, min_transmission, out=t)
+
+    rows = slice(top - extended_top, bottom - extended_top)
+    radiance = tile_rgb[rows] - airlight
+    del tile_rgb
+    radiance /= t[rows][:, :, numpy.newaxis]
+    radiance += airlight
+    pixel.from_float(radiance, dst.dtype, dst[top:bottom])
+
+def dehaze(rgb, nir, airlight=None, scale=1, dst=None):
+    """
+    Dehazes the color image rgb (BGR) with the registered nir image, both
+    8-bit, 16-bit or float32 images of the same size. airlight is the one of
+    estimate(), estimated if not given. scale is the reduction of the images
+    (e.g. of a preview), the radii being for full resolution images. Returns
+    an image of the type of rgb, written to dst if given.
+    """
+    if airlight is None:
+        airlight = estimate(rgb, scale)
+    reserved = 0
+    if dst is None:
+        dst = numpy.empty_like(rgb)
+        reserved = dst.nbytes
+
+    height = rgb.shape[0]
+    rows, concurrent = tiling(height, rgb.shape[1], scale, reserved)
+    bounds = [(top, min(height, top + rows)) for top in range(0, height, rows)]
+    # every task dehazes its share of the tiles in turn, so that at most
+    # concurrent tiles are allocated at once
+    work = lambda shares: [dehaze_tile(rgb, nir, airlight, scale, top, bottom, dst) for top, bottom in shares]
+    if concurrent == 1 or len(bounds) == 1:
+        work(bounds)
+    else:
+        get_pool().map(work, [bounds[i::concurrent] for i in range(concurrent)])
+    return dst
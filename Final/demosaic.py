@@ -0,0 +1,133 @@
+#!/usr/bin/python2
+
+"""
+Single-sensor RGB-NIR capture. The sensor has a 2x2 mosaic of filters, one
+of which only passes near infrared (layout). Without the IR-cut filter of a
+normal camera, the R, G and B filters pass NIR too, so the color pixels
+measure the visible signal plus a fraction (crosstalk) of the NIR one (Lu,
+Fredembach, Vetterli and Suesstrunk, "A device and an algorithm for the
+separation of visible and near infrared signals in a monolithic silicon
+sensor", in papers/). The color pixels are exposed so that they don't
+saturate: a sample is (visible + crosstalk nir) / (1 + crosstalk).
+
+demosaic() interpolates the four planes at every pixel and subtracts the NIR
+crosstalk from the color planes, which gives pixel-aligned rgb and nir
+images: they need no registration. Every plane is sampled once per 2x2
+block, so the interpolation is bilinear, as one convolution of the four
+sparse planes (cv2.filter2D); the reflected border keeps the parity of the
+mosaic, so the borders need no special case.
+
+mosaic() is the inverse, sampling an aligned rgb/nir pair as the sensor
+would, to test the single-sensor path with the aligned pairs of the
+repository:
+
+    ./demosaic.py RGB NIR OUTPUT.raw [--bits 10]
+
+writes the mosaic as a raw frame, which NIR_CAMERA_FILE can point to for
+camera_client.py with NIR_CAPTURE_FORMAT=rgbn.
+"""
+
+import argparse
+
+import cv2
+import numpy
+
+import pixel
+import rawframe
+
+# filter of every pixel of a 2x2 block: b, g and r (passing NIR too) and n
+layout = (('r', 'g'),
+          ('n', 'b'))
+# fraction of the nir signal measured by the color pixels
+crosstalk = {'b': 0.9, 'g': 0.85, 'r': 1.0}
+# bits per sample of the sensor
+sensor_bits = 10
+
+# order of the planes interpolated at once, b, g, r as in OpenCV images
+planes = ('b', 'g', 'r', 'n')
+
+# bilinear interpolation of a plane sampled once per 2x2 block
+kernel = numpy.outer([0.5, 1.0, 0.5], [0.5, 1.0, 0.5]).astype(numpy.float32)
+
+def offsets(plane):
+    # (row, column) of the plane in the 2x2 block
+    for row in range(2):
+        for column in range(2):
+            if layout[row][column] == plane:
+                return row, column
+    raise ValueError('plane %s not in the mosaic layout' % plane)
+
+def demosaic(raw):
+    """
+    Separates a mosaic image (2D, 8-bit, 16-bit or float32) into an rgb (BGR)
+    and a nir image of the same size and pixel type. Returns (nir, rgb).
+    """
+    height, width = raw.shape
+    samples = pixel.to_float(raw)
+
+    sparse = numpy.zeros((height, width, len(planes)), numpy.float32)
+    for index, plane in enumerate(planes):
+        row, column = offsets(plane)
+        sparse[row::2, column::2, index] = samples[row::2, column::2]
+    dense = cv2.filter2D(sparse, -1, kernel, borderType=cv2.BORDER_REFLECT_101)
+
+    nir = dense[:, :, 3]
+    gains = numpy.array([1 + crosstalk[plane] for plane in planes[:3]], numpy.float32)
+    leaks = numpy.array([crosstalk[plane] for plane in planes[:3]], numpy.float32)
+    rgb = dense[:, :, :3] * gains - nir[:, :, numpy.newaxis] * leaks
+
+    return pixel.from_float(nir, raw.dtype), pixel.from_float(rgb, raw.dtype)
+
+def mosaic(rgb, nir, dtype=None):
+    """
+    Mosaic image the sensor would capture of a scene with the aligned rgb
+    (BGR) and nir images, in their pixel type or dtype.
+    """
+    rgb = pixel.to_float(rgb)
+    nir = pixel.to_float(nir)
+    samples = numpy.empty(nir.shape, numpy.float32)
+    for index, plane in enumerate(planes):
+        row, column = offsets(plane)
+        if plane == 'n':
+            samples[row::2, column::2] = nir[row::2, column::2]
+        else:
+            visible = rgb[row::2, column::2, index]
+            samples[row::2, column::2] = (visible + crosstalk[plane] * nir[row::2, column::2]) / (1 + crosstalk[plane])
+    return samples if dtype is None else pixel.from_float(samples, dtype)
+
+def write_mosaic(filename, raw, bits):
+    # raw frame as the sensor driver writes it, samples of bits bits
+    height, width = raw.shape
+    buffer = rawframe.FrameBuffer(width, height, rawframe.FORMAT_RGBN, bits)
+    if bits > 8:
+        raw = numpy.right_shift(raw, 16 - bits)
+    buffer.image()[...] = raw
+    rawframe.write(filename, buffer.frame())
+    buffer.close()
+
+def main():
+    parser = argparse.ArgumentParser(description='Writes the mosaic an RGB-NIR sensor would capture of an aligned pair.')
+    parser.add_argument('rgb')
+    parser.add_argument('nir')
+    parser.add_argument('output')
+    parser.add_argument('--bits', type=int, default=sensor_bits, help='bits per sample (default: %(default)s)')
+    args = parser.parse_args()
+
+    rgb = cv2.imread(args.rgb, cv2.IMREAD_COLOR)
+    nir = cv2.imread(args.nir, cv2.IMREAD_GRAYSCALE)
+    if rgb is None or nir is None or rgb.shape[:2] != nir.shape:
+        parser.error('the rgb and nir images must be aligned images of the same size')
+
+    raw = mosaic(rgb, nir, numpy.uint8 if args.bits <= 8 else numpy.uint16)
+    if args.bits > 8:
+        # precision of the sensor
+        raw = pixel.full_scale(numpy.right_shift(raw, 16 - args.bits), args.bits)
+    write_mosaic(args.output, raw, args.bits)
+
+    recovered_nir, recovered_rgb = demosaic(raw)
+    print('%s: %d x %d mosaic, %d bits, separated with PSNR %.1f dB (rgb) and %.1f dB (nir)' % (
+        args.output, raw.shape[1], raw.shape[0], args.bits,
+        pixel.psnr(pixel.to_uint8(recovered_rgb), rgb), pixel.psnr(pixel.to_uint8(recovered_nir), nir)))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,353 @@
+import threading
+import time
+from multiprocessing.pool import ThreadPool
+
+import numpy
+
+import cache
+import tracing
+
+# number of buffers preallocated for every frame shape used in a graph
+frames_per_pool = 2
+
+# maximum number of independent branches of a graph run at the same time
+branch_threads = 4
+
+
+def is_buffer(data, buffer):
+    # true if data is the given buffer (OpenCV may return a new array object
+    # wrapping the dst buffer it was given)
+    return isinstance(data, numpy.ndarray) and data.shape == buffer.shape and \
+        data.__array_interface__['data'][0] == buffer.__array_interface__['data'][0]
+
+
+class Frame(object):
+    """
+    Reference-counted image buffer. Frames taken from a FramePool go back to
+    it when their last reference is released, so their memory is reused by
+    the next capture instead of being reallocated.
+    """
+
+    def __init__(self, data, pool=None):
+        self.data = data
+        self.pool = pool
+        self.refs = 1
+
+    def retain(self, count=1):
+        self.refs += count
+        return self
+
+    def release(self):
+        if self.refs <= 0:
+            raise RuntimeError('frame released too many times')
+        self.refs -= 1
+        if self.refs == 0 and self.pool is not None:
+            self.pool.recycle(self)
+
+
+class FramePool(object):
+    """
+    Set of preallocated buffers of the same shape and type. The pool grows
+    if more buffers than preallocated are in use at the same time.
+    """
+
+    def __init__(self, shape, dtype, count=frames_per_pool):
+        self.shape = tuple(shape)
+        self.dtype = numpy.dtype(dtype)
+        self.lock = threading.Lock()
+        self.free = [numpy.empty(self.shape, self.dtype) for _ in range(count)]
+        self.count = count
+
+    def acquire(self):
+        with self.lock:
+            if not self.free:
+                self.free.append(numpy.empty(self.shape, self.dtype))
+                self.count += 1
+            return Frame(self.free.pop(), self)
+
+    def recycle(self, frame):
+        with self.lock:
+            self.free.append(frame.data)
+        frame.data = None
+
+
+class Node(object):
+    """
+    Processing stage of a Graph.
+
+    function is called with the data of the frames named in inputs and
+    returns the data of its outputs (a tuple if there is more than one
+    output name, nothing for sinks). If output_spec is given, it is called
+    with the same arguments and returns the (shape, dtype) of the output:
+    the graph then passes a pooled buffer to function as its dst keyword
+    argument.
+
+    parameters returns a dictionary of the parameters the outputs depend on
+    besides the inputs (read when the graph runs, so that changing them
+    invalidates the cached outputs). Outputs of nodes with cached set to
+    False are never cached.
+    """
+
+    def __init__(self, name, function, inputs=(), outputs=None, output_spec=None, parameters=None, cached=True):
+        self.name = name
+        self.function = function
+        self.inputs = list(inputs)
+        self.outputs = [name] if outputs is None else list(outputs)
+        self.output_spec = output_spec
+        self.parameters = parameters
+        self.cached = cached
+        self.time = 0.0
+        self.total_time = 0.0
+        self.runs = 0
+
+    def is_sink(self):
+        return len(self.outputs) == 0
+
+
+class FileSink(Node):
+    """
+    Node encoding its input to a file, using writer(filename, data).
+    """
+
+    def __init__(self, name, input, filename, writer):
+        Node.__init__(self, name, lambda data: writer(filename, data), [input], [], cached=False)
+        self.filename = filename
+
+
+class Graph(object):
+    """
+    Processing graph exchanging frames in memory between its nodes. Files are
+    only read or written by the nodes doing so explicitly (typically
+    FileSink). Nodes are executed in the order they were added, which must
+    be a topological order.
+
+    With a cache.Cache, the frames computed are cached and the nodes whose
+    outputs are in the cache are not run again.
+    """
+
+    def __init__(self, frame_cache=None):
+        self.nodes = []
+        self.producers = {}
+        self.pools = {}
+        # guards pools, used by the branches run concurrently
+        self.lock = threading.Lock()
+        self.cache = frame_cache
+        self.branch_pool = None
+
+    def add(self, node):
+        for input in node.inputs:
+            if input not in self.producers:
+                raise ValueError('node %s: unknown input %s' % (node.name, input))
+        for output in node.outputs:
+            if output in self.producers:
+                raise ValueError('node %s: output %s already produced' % (node.name, output))
+            self.producers[output] = node
+        self.nodes.append(node)
+        return node
+
+    def pool(self, shape, dtype):
+        key = (tuple(shape), numpy.dtype(dtype).str)
+        with self.lock:
+            if key not in self.pools:
+                self.pools[key] = FramePool(shape, dtype)
+            return self.pools[key]
+
+    def schedule(self, targets, available=(), lookup=None):
+        # nodes needed to produce the targets (frame or node names) from the
+        # available frames, or from the frames found by lookup(name)
+        needed = set()
+        pending = list(targets)
+        while pending:
+            name = pending.pop()
+            if name in available or (lookup is not None and lookup(name)):
+                continue
+            node = self.producers.get(name)
+            if node is None:
+                node = [n for n in self.nodes if n.name == name][0]
+            if node not in needed:
+                needed.add(node)
+                for input in node.inputs:
+                    pending.append(input)
+        return [node for node in self.nodes if node in needed]
+
+    def run(self, targets, sources=None, on_target=None):
+        """
+        Runs the nodes needed to produce the targets (frame or sink names) and
+        returns a dictionary of the target frames. sources maps frame names to data provided by
+        the caller. The caller owns the returned frames and must release
+        them. on_target(name, data) is called for every target frame as soon
+        as it is available, e.g. to stream it while the other targets are
+        computed.
+        """
+        sources = sources or {}
+        keys = {}
+        if self.cache is not None:
+            keys = self.keys(targets, sources)
+            hits = {}
+
+            def lookup(name):
+                if name in keys and name not in hits:
+                    data = self.cache.get(keys[name])
+                    if data is not None:
+                        hits[name] = data
+                return name in hits
+
+            nodes = self.schedule(targets, sources, lookup)
+            sources = dict(sources)
+            sources.update(hits)
+        else:
+            nodes = self.schedule(targets, sources)
+
+        # number of pending reads of every frame
+        readers = {}
+        for node in nodes:
+            for input in node.inputs:
+                readers[input] = readers.get(input, 0) + 1
+        for target in targets:
+            readers[target] = readers.get(target, 0) + 1
+
+        frames = {}
+        for name, data in sources.items():
+            frames[name] = Frame(data)
+            frames[name].refs = readers.get(name, 0)
+
+        try:
+            if on_target is not None:
+                for target in targets:
+                    if target in frames:
+                        on_target(target, frames[target].data)
+            for node in nodes:
+                self.run_node(node, frames, readers, keys)
+                if on_target is not None:
+                    for name in node.outputs:
+                        if name in targets:
+                            on_target(name, frames[name].data)
+        except Exception:
+            # give the pooled buffers back before propagating the error
+            for frame in frames.values():
+                if frame.refs > 0 and frame.pool is not None:
+                    frame.refs = 1
+                    frame.release()
+            raise
+
+        return dict((target, frames[target]) for target in targets if target in frames)
+
+    def branches(self, targets, available=()):
+        # groups of targets that don't need any node in common, so that the
+        # groups can be computed independently
+        groups = []
+        for target in targets:
+            nodes = set(self.schedule([target], available))
+            joined = [group for group in groups if group[1] & nodes]
+            for group in joined:
+                groups.remove(group)
+                target_names, group_nodes = group
+                nodes |= group_nodes
+            groups.append(([t for g in joined for t in g[0]] + [target], nodes))
+        return [group[0] for group in groups]
+
+    def run_branches(self, targets, sources=None):
+        """
+        Like run, but the independent branches of the graph leading to the
+        targets (e.g. several operations on the same registered images) are
+        run concurrently on separate threads, sharing the sources. The
+        results are returned once all branches are done.
+        """
+        sources = sources or {}
+        groups = self.branches(targets, sources)
+        if len(groups) <= 1:
+            return self.run(targets, sources)
+
+        if self.branch_pool is None:
+            self.branch_pool = ThreadPool(branch_threads)
+        pending = [self.branch_pool.apply_async(self.run, (group, sources)) for group in groups]
+
+        results = {}
+        error = None
+        for branch in pending:
+            try:
+                results.update(branch.get())
+            except Exception as e:
+                error = error or e
+        if error is not None:
+            for frame in results.values():
+                frame.release()
+            raise error
+        return results
+
+    def keys(self, targets, sources):
+        """
+        Cache keys of the frames needed for the targets: sources are keyed
+        by their content, the outputs of cached nodes by their inputs and
+        parameters. Frames depending on an output that isn't cached have no
+        key.
+        """
+        keys = {}
+        for node in self.schedule(targets, sources):
+            if not node.cached or node.is_sink():
+                continue
+            input_keys = []
+            for input in node.inputs:
+                if input in sources and input not in keys:
+                    keys[input] = cache.content_key(sources[input])
+                input_keys.append(keys.get(input))
+            if None in input_keys:
+                continue
+            parameters = node.parameters() if node.parameters is not None else None
+            for output in node.outputs:
+                keys[output] = cache.derived_key(node.name, parameters, input_keys, output)
+        return keys
+
+    def run_node(self, node, frames, readers, keys={}):
+        args = [frames[input].data for input in node.inputs]
+
+        start = time.time()
+        dst = None
+        kwargs = {}
+        if node.output_spec is not None:
+            dst = self.pool(*node.output_spec(*args)).acquire()
+            kwargs['dst'] = dst.data
+        try:
+            with tracing.span(node.name, 'processing'):
+                result = node.function(*args, **kwargs)
+        except Exception:
+            if dst is not None:
+                dst.release()
+            raise
+        node.time = time.time() - start
+        node.total_time += node.time
+        node.runs += 1
+
+        if node.is_sink():
+            results = ()
+        elif len(node.outputs) == 1:
+            results = (result,)
+        else:
+            results = result
+        for name, data in zip(node.outputs, results):
+            if dst is not None and is_buffer(data, dst.data):
+                frame = dst
+                dst = None
+            else:
+                frame = Frame(data)
+            if name in keys and node.cached:
+                self.cache.put(keys[name], data)
+            frames[name] = frame
+            if readers.get(name, 0) == 0:
+                frame.release()
+            else:
+                frame.refs = readers[name]
+        if dst is not None:
+            dst.release()
+
+        for input in node.inputs:
+            frames[input].release()
+
+    def timings(self):
+        # (name, last run time, number of runs, total time) for every node
+        return [(node.name, node.time, node.runs, node.total_time) for node in self.nodes]
+
+    def print_timings(self):
+        for name, last, runs, total in self.timings():
+            if runs:
+                print('%-20s %8.3f s (%d runs, %.3f s total)' % (name, last, runs, total))
@@ -0,0 +1,115 @@
+"""
+Guided filter (He, Sun and Tang, "Guided Image Filtering"): edge-preserving
+smoothing of an image src following the edges of a guide image, as a local
+linear model src ~ a * guide + b in every window. Only box filters are
+used, so the cost doesn't depend on the radius.
+
+upsample() is the joint upsampling variant ("Fast Guided Filter"): the
+linear coefficients are computed on reduced images and applied to the full
+resolution guide, which transfers the guide's edges to an image computed at
+low resolution (e.g. a mask).
+"""
+
+import cv2
+import numpy
+
+
+def box(image, radius, dst=None):
+    # mean over the (2 radius + 1)^2 window around every pixel (dst may be
+    # image itself)
+    return cv2.boxFilter(image, -1, (2 * radius + 1, 2 * radius + 1), dst, normalize=True,
+                         borderType=cv2.BORDER_REFLECT)
+
+def as_float(image):
+    # images are filtered as float32 in [0, 1]
+    if image.dtype == numpy.uint8:
+        return image.astype(numpy.float32) / 255
+    if image.dtype == numpy.uint16:
+        return image.astype(numpy.float32) / 65535
+    return image.astype(numpy.float32, copy=False)
+
+def coefficients(guide, src, radius, eps):
+    """
+    Linear coefficients (a, b) of the guided filter, averaged over the
+    windows covering every pixel. guide is a gray (h, w) or color (h, w, 3)
+    float32 image, src a (h, w) float32 image; a has the shape of guide.
+    """
+    mean_src = box(src, radius)
+
+    if guide.ndim == 2:
+        # computed in place: the filter runs on large tiles (dehazing.py)
+        mean_guide = box(guide, radius)
+        var = box(guide * guide, radius)
+        var -= mean_guide * mean_guide
+        var += eps
+        a = box(guide * src, radius)
+        a -= mean_guide * mean_src
+        a /= var
+        del var
+        b = mean_src
+        b -= a * mean_guide
+        return box(a, radius, a), box(b, radius, b)
+
+    # color guide: the 3x3 covariance of the guide channels is inverted at
+    # every pixel (closed form of the symmetric inverse)
+    channels = [guide[:, :, c] for c in range(3)]
+    means = [box(c, radius) for c in channels]
+    cov = [box(c * src, radius) - m * mean_src for c, m in zip(channels, means)]
+
+    def variance(i, j):
+        v = box(channels[i] * channels[j], radius) - means[i] * means[j]
+        return v + eps if i == j else v
+
+    rr, rg, rb = variance(0, 0), variance(0, 1), variance(0, 2)
+    gg, gb, bb = variance(1, 1), variance(1, 2), variance(2, 2)
+    inv_rr = gg * bb - gb * gb
+    inv_rg = gb * rb - rg * bb
+    inv_rb = rg * gb - gg * rb
+    inv_gg = rr * bb - rb * rb
+    inv_gb = rb * rg - rr * gb
+    inv_bb = rr * gg - rg * rg
+    det = rr * inv_rr + rg * inv_rg + rb * inv_rb
+
+    a = numpy.empty(guide.shape, numpy.float32)
+    a[:, :, 0] = (inv_rr * cov[0] + inv_rg * cov[1] + inv_rb * cov[2]) / det
+    a[:, :, 1] = (inv_rg * cov[0] + inv_gg * cov[1] + inv_gb * cov[2]) / det
+    a[:, :, 2] = (inv_rb * cov[0] + inv_gb * cov[1] + inv_bb * cov[2]) / det
+    b = mean_src - (a[:, :, 0] * means[0] + a[:, :, 1] * means[1] + a[:, :, 2] * means[2])
+    return box(a, radius), box(b, radius)
+
+def apply(guide, a, b):
+    # a * guide + b, overwriting a
+    a *= guide
+    if guide.ndim == 2:
+        a += b
+        return a
+    result = a.sum(axis=2)
+    result += b
+    return result
+
+def guided_filter(guide, src, radius, eps):
+    """
+    Filters src (h, w) guided by guide (gray or color, same size). eps is the
+    regularization, relative to the [0, 1] range of the guide: edges of the
+    guide with a variance well above eps are preserved. Returns a float32
+    image.
+    """
+    guide = as_float(guide)
+    a, b = coefficients(guide, as_float(src), radius, eps)
+    return apply(guide, a, b)
+
+def upsample(guide, src, radius, eps):
+    """
+    Upsamples src, computed on a reduced image, to the size of guide,
+    following the edges of guide. radius is in pixels of src, whose pixels
+    are expected centred on the blocks of guide they cover (as reduced by
+    cv2.resize with INTER_AREA). Returns a float32 image of the size of
+    guide.
+    """
+    height, width = guide.shape[:2]
+    guide = as_float(guide)
+    small_guide = cv2.resize(guide, (src.shape[1], src.shape[0]), interpolation=cv2.INTER_AREA)
+    a, b = coefficients(small_guide, as_float(src), radius, eps)
+    a = cv2.resize(a, (width, height), interpolation=cv2.INTER_LINEAR)
+    b = cv2.resize(b, (width, height), interpolation=cv2.INTER_LINEAR)
+    return apply(guide, a, b)
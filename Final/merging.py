@@ -1,11 +1,21 @@
 import cv2
 import numpy as np
 
-def merge(rgb, nir):
+import pixel
+
+def read_image(image, flags):
+	#decode the image file, or use the image directly if it is already decoded
+	if isinstance(image, str):
+		return cv2.imread(image, flags)
+	return image
+
+def merge(rgb, nir, d=30, sigmaC=15, sigmaS=5):
+	#rgb and nir are 8-bit, 16-bit or float images of the same type, sigmaC
+	#is given for 8-bit images and scaled to the range of the pixel type
 	#import RGB image
-	rgb = cv2.imread(rgb, 3)
+	rgb = read_image(rgb, 3)
 	#import NIR image
-	nir = cv2.imread(nir, 0)
+	nir = read_image(nir, 0)
 	#Convert RGB image into YCbCr
 	ycc = cv2.cvtColor(rgb, cv2.COLOR_BGR2YCR_CB)
 	#Split the Y, Cb, Cr channels :
@@ -18,19 +28,16 @@ def merge(rgb, nir):
 	#compute mean shift
 	shift = yMean[0] - nirMean[0]
 	#apply shift to nir image
-	nir = cv2.add(nir, shift)
+	nir = pixel.add(nir, shift)
 	#apply bilateral filter to get the base layers :
-	d = 30
-	sigmaC = 15
-	sigmaS = 5
-	nirBase = cv2.bilateralFilter(nir, d, sigmaC, sigmaS)
-	yBase = cv2.bilateralFilter(y, d, sigmaC, sigmaS)
+	nirBase = pixel.bilateral_filter(nir, d, sigmaC, sigmaS)
+	yBase = pixel.bilateral_filter(y, d, sigmaC, sigmaS)
 
 	#get detail layer for nir image:
-	nirDetail = cv2.subtract(nir,nirBase, -1)
+	nirDetail = pixel.subtract(nir,nirBase)
 
 	#add the 2 layers
-	outY = cv2.add(nirDetail,yBase, -1)
+	outY = pixel.add(nirDetail,yBase)
 	#add the chrominance information:
 	out = cv2.merge((outY, cb, cr))
 	#convert to RGB
@@ -0,0 +1,318 @@
+#!/usr/bin/python2
+
+"""
+Pose-aware mosaic of a pan-tilt sweep.
+
+The pan-tilt head rotates the camera about its center, so the homography
+between two captures follows from their servo poses (pulse widths) and the
+camera intrinsics: H = K R_a^T R_b K^-1. This homography is the prior of the
+registration of every new capture with its nearest placed neighbour: the
+keypoints are only detected in the strips where the prior says the two
+images overlap, and only matched within a small radius of where the prior
+maps them (registration.refine_homography), instead of over the whole
+images.
+
+Every capture is placed in the image plane of a camera at the reference
+pose, the center of the sweep by default, which keeps the perspective
+stretching of the outer captures low. Its layers
+(rgb, registered nir, fused image, shadow mask, all in the coordinates of
+the rgb image) are then composited tile by tile: a tile only warps the
+captures overlapping it, with feathered weights, so the full mosaic is never
+held in memory.
+
+    ./mosaic.py <archive> [--output DIR] [--tile-size 512]
+
+builds the mosaics of the captures of a sweep archive (archive.py).
+"""
+
+import argparse
+import json
+import math
+import os
+
+import cv2
+import numpy
+
+import archive
+import registration
+import stages
+from shadow_mask import ShadowMask
+
+# servo rotation per microsecond of pulse width (degrees)
+degrees_per_us = 0.09
+# pulse widths facing forward (PWM_PULSEWIDTH_MIDDLE_US of pan-tilt.c)
+center_pulsewidth_us = 1500
+# field of view of the camera (Pi camera v1), the captured images being
+# scaled from the full sensor
+horizontal_fov = 53.5
+vertical_fov = 41.4
+
+# radius (pixels) around the position predicted by the pose within which
+# keypoints are matched, which covers the error of the servo poses
+match_radius = 24.0
+# margin (pixels) added around the overlap strips
+overlap_margin = 16
+# fraction of the frame the predicted overlap must cover for the
+# registration to be attempted, below it the pose prior is used as is
+min_overlap = 0.05
+
+# size of the output tiles (pixels)
+tile_size = 512
+
+# default pan and tilt grid of a sweep (pulse widths, us)
+sweep_pan = (1300, 1700, 100)
+sweep_tilt = (1400, 1600, 100)
+
+
+def center_pose(poses):
+    # pose at the center of a set of poses
+    pans = [pose[0] for pose in poses]
+    tilts = [pose[1] for pose in poses]
+    return (min(pans) + max(pans)) / 2.0, (min(tilts) + max(tilts)) / 2.0
+
+def sweep_poses(pan=sweep_pan, tilt=sweep_tilt):
+    # grid of (pan, tilt) poses of a sweep, row by row in a serpentine order
+    # so that consecutive poses are neighbours
+    pans = list(range(pan[0], pan[1] + 1, pan[2]))
+    poses = []
+    for row, y in enumerate(range(tilt[0], tilt[1] + 1, tilt[2])):
+        poses.extend((x, y) for x in (pans if row % 2 == 0 else reversed(pans)))
+    return poses
+
+def intrinsics(shape):
+    height, width = shape[:2]
+    fx = width / 2.0 / math.tan(math.radians(horizontal_fov) / 2)
+    fy = height / 2.0 / math.tan(math.radians(vertical_fov) / 2)
+    return numpy.array([[fx, 0, width / 2.0], [0, fy, height / 2.0], [0, 0, 1]])
+
+def rotation(pose):
+    # orientation of the camera at a pose: increasing the pan pulse width
+    # turns left, increasing the tilt pulse width turns down, and the tilt
+    # servo is mounted on the pan servo
+    yaw = math.radians((pose[0] - center_pulsewidth_us) * degrees_per_us)
+    pitch = math.radians((pose[1] - center_pulsewidth_us) * degrees_per_us)
+    c, s = math.cos(-yaw), math.sin(-yaw)
+    pan = numpy.array([[c, 0, s], [0, 1, 0], [-s, 0, c]])
+    c, s = math.cos(-pitch), math.sin(-pitch)
+    tilt = numpy.array([[1, 0, 0], [0, c, -s], [0, s, c]])
+    return pan.dot(tilt)
+
+def pose_homography(pose, reference_pose, shape):
+    # homography mapping an image taken at pose on an image taken at
+    # reference_pose (pure rotation of the camera)
+    K = intrinsics(shape)
+    R = rotation(reference_pose).T.dot(rotation(pose))
+    H = K.dot(R).dot(numpy.linalg.inv(K))
+    return H / H[2, 2]
+
+def rectangle(box):
+    x0, y0, x1, y1 = box
+    return numpy.float32([[x0, y0], [x1, y0], [x1, y1], [x0, y1]]).reshape(-1, 1, 2)
+
+def mapped_box(H, box):
+    # bounding box of an (x0, y0, x1, y1) box mapped by H
+    points = cv2.perspectiveTransform(rectangle(box), H).reshape(-1, 2)
+    return points[:, 0].min(), points[:, 1].min(), points[:, 0].max(), points[:, 1].max()
+
+def bounds(H, shape):
+    # bounding box of an image of the given shape mapped by H
+    return mapped_box(H, (0, 0, shape[1], shape[0]))
+
+def window(box, shape, margin):
+    # integer window of a box grown by margin and clipped to the image, or
+    # None if it is empty
+    height, width = shape[:2]
+    x0, y0 = max(0, int(box[0]) - margin), max(0, int(box[1]) - margin)
+    x1, y1 = min(width, int(math.ceil(box[2])) + margin), min(height, int(math.ceil(box[3])) + margin)
+    if x1 <= x0 or y1 <= y0:
+        return None
+    return x0, y0, x1, y1
+
+def overlap_windows(prior, shape, reference_shape, margin=overlap_margin):
+    """
+    Windows (x0, y0, x1, y1) of an image and of its reference where the
+    prior homography (image -> reference) says they overlap, or None if the
+    overlap is too small to register them.
+    """
+    reference_window = window(bounds(prior, shape), reference_shape, margin)
+    if reference_window is None:
+        return None
+    x0, y0, x1, y1 = reference_window
+    if (x1 - x0) * (y1 - y0) < min_overlap * reference_shape[0] * reference_shape[1]:
+        return None
+    image_window = window(mapped_box(numpy.linalg.inv(prior), reference_window), shape, margin)
+    if image_window is None:
+        return None
+    return image_window, reference_window
+
+def translation(x, y):
+    return numpy.array([[1.0, 0, x], [0, 1.0, y], [0, 0, 1.0]])
+
+
+def detach(data):
+    # copy of a frame the mosaic keeps, so that pooled buffers can be reused
+    return data.copy() if isinstance(data, numpy.ndarray) else data
+
+
+class Capture(object):
+    # a capture of the sweep: pose, layers and homography to the mosaic
+
+    def __init__(self, pose, guide, layers):
+        self.pose = pose
+        self.guide = guide
+        self.layers = layers
+        self.shape = guide.shape[:2]
+        self.homography = None
+
+
+class Mosaic(object):
+    """
+    Incremental mosaic in the image plane of a camera at reference_pose
+    (the pose of the first capture if None): add() places every capture as
+    it arrives, from its pose and the images of its nearest placed
+    neighbour; write_tiles() composites a layer tile by tile.
+    """
+
+    def __init__(self, reference_pose=None):
+        self.reference_pose = reference_pose
+        self.captures = []
+
+    def neighbour(self, pose):
+        # placed capture with the closest pose
+        return min(self.captures, key=lambda c: (c.pose[0] - pose[0]) ** 2 + (c.pose[1] - pose[1]) ** 2)
+
+    def add(self, pose, guide, layers):
+        """
+        Places a capture: guide is the image registered with the neighbours
+        (the rgb image), layers a dictionary of the images (or ShadowMask)
+        composited in the mosaic, all in the coordinates of guide.
+        """
+        capture = Capture(pose, guide, layers)
+        if not self.captures:
+            # only the pose places the first capture
+            capture.homography = pose_homography(pose, self.reference_pose or pose, capture.shape)
+        else:
+            reference = self.neighbour(pose)
+            prior = pose_homography(pose, reference.pose, capture.shape)
+            windows = overlap_windows(prior, capture.shape, reference.shape)
+            H = prior
+            if windows is not None:
+                H = registration.refine_homography(guide, reference.guide, prior, match_radius, windows)
+            capture.homography = reference.homography.dot(H)
+        self.captures.append(capture)
+        return capture
+
+    def extent(self):
+        # (x0, y0, width, height) of the mosaic in the reference image plane
+        boxes = numpy.array([bounds(c.homography, c.shape) for c in self.captures])
+        x0, y0 = numpy.floor(boxes[:, :2].min(axis=0))
+        x1, y1 = numpy.ceil(boxes[:, 2:].max(axis=0))
+        return int(x0), int(y0), int(x1 - x0), int(y1 - y0)
+
+    def composite(self, name, x, y, width, height):
+        """
+        Tile of layer name at (x, y) in mosaic coordinates: the captures
+        overlapping it are warped and blended with weights decreasing
+        towards their borders. Returns None if no capture covers the tile.
+        """
+        accumulated = None
+        total = numpy.zeros((height, width), numpy.float32)
+        for capture in self.captures:
+            x0, y0, x1, y1 = bounds(capture.homography, capture.shape)
+            if x1 <= x or y1 <= y or x0 >= x + width or y0 >= y + height:
+                continue
+            layer = capture.layers[name]
+            if isinstance(layer, ShadowMask):
+                layer = layer.toArray().astype(numpy.float32)
+            M = translation(-x, -y).dot(capture.homography)
+            warped = cv2.warpPerspective(layer.astype(numpy.float32), M, (width, height), flags=cv2.INTER_LINEAR)
+            weight = cv2.warpPerspective(feather(capture.shape), M, (width, height), flags=cv2.INTER_LINEAR)
+            if accumulated is None:
+                accumulated = numpy.zeros(warped.shape, numpy.float32)
+            accumulated += warped * (weight if warped.ndim == 2 else weight[:, :, None])
+            total += weight
+        if accumulated is None:
+            return None
+        total = numpy.maximum(total, 1e-6)
+        return accumulated / (total if accumulated.ndim == 2 else total[:, :, None])
+
+    def write_tiles(self, name, directory, size=tile_size):
+        """
+        Writes layer name as tiles <directory>/<name>_<row>_<column>.<ext>
+        (PNG, or the ShadowMask format for masks) and an index
+        <directory>/<name>.json giving the grid. Returns the index.
+        """
+        x0, y0, width, height = self.extent()
+        rows, columns = (height + size - 1) // size, (width + size - 1) // size
+        sample = self.captures[0].layers[name]
+        is_mask = isinstance(sample, ShadowMask)
+        tiles = []
+        for row in range(rows):
+            for column in range(columns):
+                x, y = x0 + column * size, y0 + row * size
+                tile = self.composite(name, x, y, min(size, x0 + width - x), min(size, y0 + height - y))
+                if tile is None:
+                    continue
+                filename = '%s_%d_%d.png' % (name, row, column)
+                if is_mask:
+                    ShadowMask.fromArray(tile >= 0.5).save(os.path.join(directory, filename))
+                else:
+                    maximum = numpy.iinfo(sample.dtype).max if sample.dtype.kind in 'ui' else None
+                    if maximum is not None:
+                        tile = numpy.clip(numpy.rint(tile), 0, maximum).astype(sample.dtype)
+                    cv2.imwrite(os.path.join(directory, filename), tile)
+                tiles.append({'row': row, 'column': column, 'file': filename})
+        index = {'name': name, 'origin': [x0, y0], 'width': width, 'height': height,
+                 'tile_size': size, 'rows': rows, 'columns': columns, 'tiles': tiles}
+        with open(os.path.join(directory, name + '.json'), 'w') as f:
+            json.dump(index, f, indent=1)
+        return index
+
+# weight maps of the blending, by frame shape
+feathers = {}
+
+def feather(shape):
+    # weight of every pixel of a frame, increasing from its borders to its center
+    if shape not in feathers:
+        height, width = shape
+        x = numpy.minimum(numpy.arange(width) + 1.0, width - numpy.arange(width)) / (width / 2.0)
+        y = numpy.minimum(numpy.arange(height) + 1.0, height - numpy.arange(height)) / (height / 2.0)
+        feathers[shape] = numpy.outer(y, x).astype(numpy.float32)
+    return feathers[shape]
+
+
+def main():
+    parser = argparse.ArgumentParser(description='Build the mosaics of a pan-tilt sweep archive.')
+    parser.add_argument('archive')
+    parser.add_argument('--output', default='mosaic', help='output directory (default: %(default)s)')
+    parser.add_argument('--tile-size', type=int, default=tile_size)
+    args = parser.parse_args()
+
+    if not os.path.isdir(args.output):
+        os.makedirs(args.output)
+
+    reader = archive.Reader(args.archive)
+    g = stages.build_graph(raw=any(record.is_raw() for record in reader))
+    layers = [stages.nir_registered, stages.skin_smoothing, stages.shadow_detection_mask]
+    mosaic = Mosaic(center_pose([record.pose for record in reader]))
+    for record in reader:
+        if record.is_raw():
+            sources = {stages.nir: record.nir.pixels(), stages.rgb: record.rgb.pixels(),
+                       stages.nir_raw: record.nir, stages.rgb_raw: record.rgb}
+        else:
+            sources = {stages.nir_jpeg: record.nir, stages.rgb_jpeg: record.rgb}
+        if record.homography is not None:
+            sources[stages.homography] = record.homography
+        results = g.run([stages.rgb] + layers, sources)
+        data = dict((name, detach(frame.data)) for name, frame in results.items())
+        for frame in results.values():
+            frame.release()
+        mosaic.add(record.pose, data[stages.rgb], data)
+        print('Capture %d placed (pose %d %d)' % (record.index, record.pose[0], record.pose[1]))
+
+    for name in [stages.rgb] + layers:
+        index = mosaic.write_tiles(name, args.output, args.tile_size)
+        print('%s: %d x %d, %d tiles' % (name, index['width'], index['height'], len(index['tiles'])))
+
+if __name__ == '__main__':
+    main()
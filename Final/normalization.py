@@ -0,0 +1,78 @@
+import multiprocessing
+from multiprocessing.pool import ThreadPool
+
+import cv2
+import numpy
+
+import pixel
+
+# Number of threads computing the partial histograms
+threads = multiprocessing.cpu_count()
+
+# CLAHE parameters
+clahe_clip_limit = 2.0
+clahe_tile_grid_size = (8, 8)
+
+# Worker threads, created on first use
+pool = None
+
+def get_pool():
+    global pool
+    if pool is None:
+        pool = ThreadPool(threads)
+    return pool
+
+def sub_histogram(strip):
+    # histogram of a strip of the image (cv2.calcHist releases the GIL, so
+    # the strips are processed in parallel)
+    return pixel.histogram(strip)
+
+def histogram(grayscale):
+    # histogram of an 8-bit or 16-bit grayscale image, with one bin per
+    # value, computed as one sub-histogram per thread over horizontal strips
+    # and summed
+    rows = grayscale.shape[0]
+    count = max(1, min(threads, rows))
+    bounds = [(rows * i) // count for i in range(count + 1)]
+    strips = [grayscale[bounds[i]:bounds[i + 1]] for i in range(count)]
+
+    if count == 1:
+        return sub_histogram(strips[0])
+    return numpy.sum(get_pool().map(sub_histogram, strips), axis=0)
+
+def equalization_table(hist, dtype=numpy.uint8):
+    # Lookup table mapping the cumulative histogram to the range of dtype.
+    # Values below the darkest pixel of the image are mapped to 0.
+    cdf = hist.cumsum()
+
+    used = cdf != 0
+    cdf_min = cdf[used].min()
+    cdf_max = cdf[used].max()
+    if cdf_max == cdf_min:
+        return numpy.zeros(len(hist), dtype=dtype)
+
+    table = numpy.zeros(len(hist), dtype=numpy.int64)
+    table[used] = ((cdf[used] - cdf_min) * pixel.maximum(dtype)) // (cdf_max - cdf_min)
+    return table.astype(dtype)
+
+def equalize(grayscale, dst=None):
+    # Histogram equalization of an 8-bit or 16-bit grayscale image already in
+    # memory, in its own pixel type. The table is applied with cv2.LUT (or
+    # numpy indexing for 16-bit images), which is vectorized, and written to
+    # dst if given so that the caller can reuse its buffers.
+    table = equalization_table(histogram(grayscale), grayscale.dtype)
+    return pixel.apply_table(grayscale, table, dst)
+
+def clahe(grayscale, dst=None, clip_limit=clahe_clip_limit, tile_grid_size=clahe_tile_grid_size):
+    # Contrast limited adaptive histogram equalization. OpenCV computes the
+    # tile histograms and interpolates the tiles in parallel.
+    operator = cv2.createCLAHE(clipLimit=clip_limit, tileGridSize=tile_grid_size)
+    if dst is None:
+        return operator.apply(grayscale)
+    return operator.apply(grayscale, dst=dst)
+
+def normalize(grayscale, dst=None, adaptive=False):
+    # Normalize the nir image before registration
+    if adaptive:
+        return clahe(grayscale, dst)
+    return equalize(grayscale, dst)
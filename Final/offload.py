@@ -0,0 +1,426 @@
+#!/usr/bin/python2
+
+"""
+Offloading of the heavy pipeline stages (registration, fusion, shadow
+detection) to a worker process on a stronger host.
+
+For an offloaded stage, the frames the stage reads and the processing
+parameters are sent to the worker, which runs the same graph (stages.py) and
+streams every result back as soon as it is computed. Sinks (files, archive)
+always run locally, on the frames received.
+
+The stage runs locally or remotely, job by job, whichever is expected to be
+faster: the local cost is the measured time of the stage, the remote cost
+the measured time on the worker plus the transfers at the measured link
+bandwidth and latency. Both sides are measured again from time to time, and
+the stage falls back to local execution while the worker is unreachable.
+
+Messages use the framing of cluster.py. Frames are sent from their buffers
+and received in place. Nothing received is unpickled or executed: frames are
+arrays, bytes, raw frames, shadow masks or plain values (JSON), and the
+worker only applies parameters known to stages.parameters(). The worker has
+no authentication, so it only listens on the loopback interface unless
+given the address of a trusted network.
+
+    ./offload.py [--bind 127.0.0.1] [--port 1315] [--cache DIR]    runs a worker
+"""
+
+import argparse
+import numbers
+import socket
+import threading
+import time
+
+import numpy
+
+import cache
+import cluster
+import rawframe
+import shadow_mask
+import stages
+import tracing
+
+# constants
+port = 1315
+
+# message types (after those of cluster.py)
+MSG_JOB = 16     # client -> worker: {'index', 'targets', 'frames', 'parameters', 'graph'} + frames
+MSG_RESULT = 17  # worker -> client: {'frames'} + frames
+MSG_DONE = 18    # worker -> client: {'compute_time'}
+MSG_ERROR = 19   # worker -> client: {'error'}
+MSG_PING = 20    # both ways, measures the latency
+
+# weight of the last measure in the running averages of the costs
+smoothing = 0.3
+# every explore_interval jobs, the stage also runs where it isn't expected to
+# be faster, to follow the changes of the costs
+explore_interval = 16
+# time the stages run locally after the worker failed
+retry_interval = 30.0
+# timeout of the connection to the worker
+connect_timeout = 2.0
+# interface the worker listens on
+bind_address = '127.0.0.1'
+
+
+# Frames on the wire: every frame is described in the metadata by its name,
+# kind and size, and its data is appended to the payload.
+
+def encode_frame(name, data):
+    # (description, buffers) of a frame
+    if isinstance(data, numpy.ndarray):
+        data = numpy.ascontiguousarray(data)
+        return {'name': name, 'kind': 'array', 'dtype': data.dtype.str, 'shape': data.shape,
+                'size': data.nbytes}, [memoryview(data.reshape(-1).view(numpy.uint8))]
+    if isinstance(data, bytes):
+        return {'name': name, 'kind': 'bytes', 'size': len(data)}, [data]
+    if isinstance(data, rawframe.RawFrame):
+        return {'name': name, 'kind': 'raw', 'size': rawframe.frame_size(data)}, \
+            [data.header.pack(), memoryview(data.payload)]
+    if isinstance(data, shadow_mask.ShadowMask):
+        packed = numpy.ascontiguousarray(data.packed)
+        return {'name': name, 'kind': 'mask', 'height': data.height, 'width': data.width,
+                'size': packed.nbytes}, [memoryview(packed.reshape(-1))]
+    # plain values (shadow threshold, pose, ...) travel in the metadata
+    if isinstance(data, numpy.generic):
+        data = data.item()
+    if not isinstance(data, (numbers.Number, type(u''), tuple, list, type(None))):
+        raise TypeError('frame %s: %s can not be sent to the worker' % (name, type(data).__name__))
+    return {'name': name, 'kind': 'value', 'value': data, 'size': 0}, []
+
+def decode_frames(descriptions, payload):
+    # name -> data of the frames of a message, arrays and raw frames are
+    # views on the payload
+    frames = {}
+    offset = 0
+    for d in descriptions:
+        if d['kind'] == 'array':
+            dtype = numpy.dtype(str(d['dtype']))
+            data = numpy.frombuffer(payload, dtype, d['size'] // dtype.itemsize, offset).reshape(d['shape'])
+        elif d['kind'] == 'raw':
+            data = rawframe.from_buffer(payload, offset)
+        elif d['kind'] == 'bytes':
+            data = bytes(payload[offset:offset + d['size']])
+        elif d['kind'] == 'mask':
+            packed = numpy.frombuffer(payload, numpy.uint8, d['size'], offset)
+            data = shadow_mask.ShadowMask(d['height'], d['width'], packed.reshape(d['height'], -1))
+        elif d['kind'] == 'value':
+            # JSON has no tuples
+            data = tuple(d['value']) if isinstance(d['value'], list) else d['value']
+        else:
+            raise ValueError('frame %s: unknown kind %s' % (d['name'], d['kind']))
+        frames[d['name']] = data
+        offset += d['size']
+    return frames
+
+def send_frames(sock, type, meta, frames):
+    # sends a message carrying frames (name -> data), returns its size
+    encoded = [encode_frame(name, data) for name, data in frames.items()]
+    meta = dict(meta, frames=[description for description, _ in encoded])
+    size = sum(description['size'] for description, _ in encoded)
+    message = cluster.pack_message(type, meta, size)
+    sock.sendall(message)
+    for _, buffers in encoded:
+        for buffer in buffers:
+            sock.sendall(buffer)
+    return len(message) + size
+
+
+def check_parameters(parameters):
+    # the parameters of a job are set on the modules of the worker: only the
+    # numbers of stages.parameters() are accepted
+    known = stages.parameters()
+    for group, values in parameters.items():
+        if group not in known:
+            raise ValueError('unknown parameter group %r' % group)
+        for name, value in values.items():
+            if name not in known[group]:
+                raise ValueError('unknown parameter %s.%s' % (group, name))
+            if isinstance(value, bool) or not isinstance(value, numbers.Real):
+                raise ValueError('parameter %s.%s is not a number' % (group, name))
+    for group in known:
+        if group not in parameters:
+            raise ValueError('missing parameter group %r' % group)
+
+def parse_address(address):
+    # (host, port) of a 'host[:port]' worker address
+    host, _, worker_port = address.partition(':')
+    return host, int(worker_port) if worker_port else port
+
+
+class WorkerError(Exception):
+    # job failed on the worker, the connection is still usable
+    pass
+
+
+class Cost(object):
+    """
+    Running averages of the costs of a stage: local time, remote compute
+    time, bytes sent and received per job. The stage runs locally until
+    unavailable_until after failing on the worker.
+    """
+
+    def __init__(self):
+        self.local = None
+        self.remote = None
+        self.sent = None
+        self.received = None
+        self.local_runs = 0
+        self.remote_runs = 0
+        self.unavailable_until = 0.0
+
+    @staticmethod
+    def update(average, value):
+        return value if average is None else (1 - smoothing) * average + smoothing * value
+
+    def remote_estimate(self, link):
+        # expected time of the stage on the worker, transfers included
+        if self.remote is None or link.bandwidth is None:
+            return None
+        return link.latency + (self.sent + self.received) / link.bandwidth + self.remote
+
+
+class Link(object):
+    # measured latency (s) and bandwidth (bytes/s) of the connection to the worker
+
+    def __init__(self):
+        self.latency = 0.0
+        self.bandwidth = None
+
+    def update(self, transferred, transfer_time):
+        if transfer_time > 0:
+            self.bandwidth = Cost.update(self.bandwidth, transferred / transfer_time)
+
+
+class Offloader(object):
+    """
+    Connection to a worker (at 'host[:port]') and scheduler of the offloaded
+    stages. raw, preview and rgbn are the options the graph was built with
+    (stages.build_graph), which the worker uses for its own graph.
+    """
+
+    def __init__(self, address, raw=False, preview=False, rgbn=False):
+        self.address = parse_address(address)
+        self.options = {'raw': raw, 'preview': preview, 'rgbn': rgbn}
+        self.sock = None
+        self.lock = threading.Lock()
+        self.link = Link()
+        self.costs = {}
+        self.unavailable_until = 0.0
+
+    def connect(self):
+        self.sock = socket.create_connection(self.address, connect_timeout)
+        self.sock.settimeout(None)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+        start = time.time()
+        cluster.send_message(self.sock, MSG_PING, {})
+        cluster.receive_message(self.sock)
+        self.link.latency = time.time() - start
+        print('Offloading to %s:%d (latency %.3f ms)' % (self.address[0], self.address[1], self.link.latency * 1000))
+
+    def disconnect(self):
+        if self.sock is not None:
+            self.sock.close()
+            self.sock = None
+
+    def remote_targets(self, g, targets, available):
+        # frames the worker computes for the targets: the frame targets and
+        # the inputs of the sinks, which run locally
+        result = []
+        for target in targets:
+            node = g.producers.get(target)
+            if node is None:
+                node = [n for n in g.nodes if n.name == target][0]
+            names = node.inputs if node.is_sink() else [target]
+            result.extend(name for name in names if name not in available and name not in result)
+        return result
+
+    def run_remote(self, g, index, targets, data, cost):
+        """
+        Computes the targets on the worker from the frames of data they need,
+        and returns them (name -> data) as they were streamed back.
+        """
+        nodes = g.schedule(targets, data)
+        inputs = set(input for node in nodes for input in node.inputs if input in data)
+        frames = dict((name, data[name]) for name in inputs)
+
+        with self.lock:
+            if self.sock is None:
+                self.connect()
+            start = time.time()
+            with tracing.span('offload', 'transfer', index=index):
+                sent = send_frames(self.sock, MSG_JOB, {'index': index, 'targets': targets,
+                                                        'parameters': stages.parameters(), 'graph': self.options}, frames)
+                results = {}
+                received = 0
+                while True:
+                    message_type, meta, payload = cluster.receive_message(self.sock)
+                    received += cluster.header_size + len(payload)
+                    if message_type == MSG_RESULT:
+                        results.update(decode_frames(meta['frames'], payload))
+                    elif message_type == MSG_DONE:
+                        break
+                    elif message_type == MSG_ERROR:
+                        raise WorkerError(meta['error'])
+            elapsed = time.time() - start
+
+        compute_time = meta['compute_time']
+        self.link.update(sent + received, elapsed - compute_time - self.link.latency)
+        cost.remote = Cost.update(cost.remote, compute_time)
+        cost.sent = Cost.update(cost.sent, sent)
+        cost.received = Cost.update(cost.received, received)
+        cost.remote_runs += 1
+        return results
+
+    def choose_remote(self, cost):
+        # True if the next job of the stage should run on the worker
+        if time.time() < max(self.unavailable_until, cost.unavailable_until):
+            return False
+        if cost.local is None:
+            return False
+        remote = cost.remote_estimate(self.link)
+        if remote is None:
+            return True
+        runs = cost.local_runs + cost.remote_runs
+        faster_remote = remote < cost.local
+        if runs % explore_interval == 0:
+            return not faster_remote
+        return faster_remote
+
+    def stage(self, name, g, local, targets=None):
+        """
+        Stage function running the pipeline stage function local, or its
+        targets (the job's targets if None) on the worker followed by the
+        local sinks.
+        """
+        cost = self.costs.setdefault(name, Cost())
+
+        def run(job):
+            if self.choose_remote(cost):
+                wanted = job.targets if targets is None else targets
+                data = job.data()
+                try:
+                    results = self.run_remote(g, job.index, self.remote_targets(g, wanted, data), data, cost)
+                except WorkerError as e:
+                    print('Offloaded %s failed on the worker, running locally: %s' % (name, e))
+                    cost.unavailable_until = time.time() + retry_interval
+                except (IOError, OSError, socket.error) as e:
+                    print('Offloading of %s failed, running locally: %s' % (name, e))
+                    self.disconnect()
+                    self.unavailable_until = time.time() + retry_interval
+                else:
+                    data.update(results)
+                    job.add(g.run(wanted, data))
+                    return job
+
+            start = time.time()
+            job = local(job)
+            cost.local = Cost.update(cost.local, time.time() - start)
+            cost.local_runs += 1
+            return job
+
+        return run
+
+    def print_stats(self):
+        bandwidth = self.link.bandwidth / 1048576.0 if self.link.bandwidth else 0.0
+        print('offload: latency %.3f ms, bandwidth %.1f MB/s' % (self.link.latency * 1000, bandwidth))
+        for name, cost in sorted(self.costs.items()):
+            remote = cost.remote_estimate(self.link)
+            print('%-16s local %3d jobs (%s), remote %3d jobs (%s)'
+                  % (name, cost.local_runs, '%.3f s' % cost.local if cost.local is not None else '-',
+                     cost.remote_runs, '%.3f s' % remote if remote is not None else '-'))
+
+
+class Worker(object):
+    """
+    Runs the jobs of the clients on graphs built like theirs, one graph per
+    set of build options. Jobs are run one at a time, as the processing
+    parameters are global.
+    """
+
+    def __init__(self, frame_cache=None):
+        self.frame_cache = frame_cache
+        self.graphs = {}
+        self.lock = threading.Lock()
+
+    def graph(self, options):
+        key = tuple(sorted(options.items()))
+        if key not in self.graphs:
+            self.graphs[key] = stages.build_graph(frame_cache=self.frame_cache, **options)
+        return self.graphs[key]
+
+    def run(self, sock, meta, frames):
+        # computes the targets in one run of the graph (the frames they share
+        # are computed once), sending every result as soon as it is computed;
+        # the pooled buffers are released once all of them are sent. Returns
+        # the compute time, without the time spent sending
+        with self.lock:
+            start = time.time()
+            sending = [0.0]
+
+            def send(name, data):
+                send_start = time.time()
+                send_frames(sock, MSG_RESULT, {}, {name: data})
+                sending[0] += time.time() - send_start
+
+            check_parameters(meta['parameters'])
+            stages.set_parameters(meta['parameters'])
+            g = self.graph(meta['graph'])
+            results = g.run(meta['targets'], frames, send)
+            for frame in results.values():
+                frame.release()
+            return time.time() - start - sending[0]
+
+    def serve(self, sock, address):
+        print('Client connected from %s' % address[0])
+        try:
+            while True:
+                try:
+                    message_type, meta, payload = cluster.receive_message(sock)
+                except IOError:
+                    break
+                if message_type == MSG_PING:
+                    cluster.send_message(sock, MSG_PING, {})
+                    continue
+                if message_type != MSG_JOB:
+                    continue
+                try:
+                    with tracing.span('job', 'processing', index=meta['index']):
+                        compute_time = self.run(sock, meta, decode_frames(meta['frames'], payload))
+                except Exception as e:
+                    cluster.send_message(sock, MSG_ERROR, {'error': '%s: %s' % (type(e).__name__, e)})
+                    continue
+                cluster.send_message(sock, MSG_DONE, {'compute_time': compute_time})
+        finally:
+            sock.close()
+            print('Client %s disconnected' % address[0])
+
+def main():
+    parser = argparse.ArgumentParser(description='Worker running the offloaded pipeline stages.')
+    parser.add_argument('--bind', default=bind_address,
+                        help='address of the interface to listen on, e.g. 0.0.0.0 on a trusted network (default: %(default)s)')
+    parser.add_argument('--port', type=int, default=port)
+    parser.add_argument('--cache', help='directory caching the intermediate frames between jobs')
+    args = parser.parse_args()
+
+    worker = Worker(cache.Cache(args.cache) if args.cache else None)
+    listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    listener.bind((args.bind, args.port))
+    listener.listen(4)
+    print('Worker listening on %s:%d' % (args.bind, args.port))
+    try:
+        while True:
+            sock, address = listener.accept()
+            sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            thread = threading.Thread(target=worker.serve, args=(sock, address))
+            thread.daemon = True
+            thread.start()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        listener.close()
+        tracing.export()
+
+if __name__ == '__main__':
+    main()
@@ -13,6 +13,26 @@
  *
  * Be sure to run as root!
  *
+ * Run with --sweep to drive the pan-tilt module from stdin instead of the
+ * joystick, for the panorama sweeps of the control program: every line
+ * "MOVE <pan> <tilt>" moves the servos to the given pulse widths (us), waits
+ * for them to settle and answers "POSE <pan> <tilt>" with the pulse widths
+ * actually applied. "END" or the end of stdin exits.
+ *
+ * Set PAN_TILT_OUTPUT to "wave" to drive both servos from one DMA waveform
+ * instead of two independent gpioServo() outputs: both pulses start together
+ * at the beginning of every servo frame, both are updated at the same frame
+ * boundary, and the pulsewidths have a resolution of 1 us, so the joystick
+ * moves the servos by 1 to PWM_PULSEWIDTH_STEP_US per frame depending on how
+ * far it is pushed.
+ *
+ * To run without the hardware, compile against the simulated pigpio library
+ * in sim/ (see sim/pigpio.h), which logs the pulses sent to the servos:
+ *     gcc -std=gnu11 -Wall -funsigned-char -Isim pan-tilt.c sim/pigpio.c -o pan-tilt-sim -pthread
+ *
+ * Set PAN_TILT_TRACE to a file name to record a trace of the control loop in
+ * the Chrome trace event format (see tracing.py).
+ *
  * Author: Sahand Kashani-Akhavan [sahand.kashani-akhavan@epfl.ch]
  */
 
@@ -23,8 +43,10 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #define SPI_CHANNEL              (0)
@@ -61,13 +83,35 @@
 #define PWM_PULSEWIDTH_MIDDLE_US ((PWM_PULSEWIDTH_MIN_US + PWM_PULSEWIDTH_MAX_US) / 2)
 #define PWM_PULSEWIDTH_INIT_US   (PWM_PULSEWIDTH_MIDDLE_US)
 #define PWM_PULSEWIDTH_STEP_US   (10)
+#define PWM_WAVE_STEP_MIN_US     (1) /* step at the joystick thresholds, in wave output */
+#define PWM_WAVE_POLL_US         (1000)
 
 #define USLEEP_DELAY             (1 * PWM_GPIO_RANGE_US) /* MUST be a multiple of PWM_GPIO_RANGE_US to avoid modifying the servo when it isn't expecting it */
 
 #define OP_SKIN_SMOOTHING        (0)
 #define OP_SHADOW_DETECTION      (1)
+#define OP_ALL                   (2)
+#define OP_DEHAZING              (3)
 #define OP_SKIN_SMOOTHING_STR    "OP_SKIN_SMOOTHING"
 #define OP_SHADOW_DETECTION_STR  "OP_SHADOW_DETECTION"
+#define OP_ALL_STR               "OP_ALL"
+#define OP_DEHAZING_STR          "OP_DEHAZING"
+
+/* time given to the servos to reach a pose of a sweep and stop oscillating
+   before the pose is acknowledged (a multiple of PWM_GPIO_RANGE_US) */
+#define SWEEP_SETTLE_US          (25 * PWM_GPIO_RANGE_US)
+#define SWEEP_ARG                "--sweep"
+#define SWEEP_LINE_MAX           (64)
+
+#define OUTPUT_ENV               "PAN_TILT_OUTPUT"
+#define OUTPUT_WAVE_STR          "wave"
+#define OUTPUT_SERVO             (0)
+#define OUTPUT_WAVE              (1)
+
+#define TRACE_FILE_ENV           "PAN_TILT_TRACE"
+#define TRACE_MAX_EVENTS         (8192) /* per thread, about 160 s of control loop */
+#define TRACE_TID_MAIN           (1)
+#define TRACE_TID_ISR            (2)
 
 /*
  * struct joystick_t
@@ -79,10 +123,46 @@ struct joystick_t {
     uint32_t y;
 };
 
+/*
+ * struct trace_event_t
+ *
+ * Span of time recorded for the trace. Events without duration have
+ * end_us == 0.
+ */
+struct trace_event_t {
+    const char *name;
+    uint64_t start_us;
+    uint64_t end_us;
+};
+
+/*
+ * struct trace_buffer_t
+ *
+ * Events recorded by one thread. Every thread writes to its own buffer, so
+ * recording an event doesn't need any locking.
+ */
+struct trace_buffer_t {
+    const char *thread_name;
+    uint32_t tid;
+    uint32_t count;
+    uint32_t dropped;
+    struct trace_event_t events[TRACE_MAX_EVENTS];
+};
+
 /* global variables */
 int fd_spi = 0;
 volatile bool joystick_button_pressed = false;
 volatile bool joystick_button_pressed_handling = false;
+const char *trace_file = NULL;
+uint32_t output = OUTPUT_SERVO;
+uint32_t pulsewidth_x_us = PWM_PULSEWIDTH_INIT_US;
+uint32_t pulsewidth_y_us = PWM_PULSEWIDTH_INIT_US;
+int wave_id = -1; /* waveform being transmitted, in wave output */
+uint32_t wave_x_us = 0;
+uint32_t wave_y_us = 0;
+bool wave_switched = false; /* the last send_wave() waited for a frame boundary */
+struct trace_buffer_t trace_main = {.thread_name = "main", .tid = TRACE_TID_MAIN};
+struct trace_buffer_t trace_isr = {.thread_name = "joystick_button_isr", .tid = TRACE_TID_ISR};
 
 uint32_t read_joystick_x();
 uint32_t read_joystick_y();
@@ -96,19 +176,30 @@ bool is_joystick_full_left(struct joystick_t joystick);
 bool is_joystick_full_right(struct joystick_t joystick);
 bool is_joystick_full_up(struct joystick_t joystick);
 bool is_joystick_full_down(struct joystick_t joystick);
-uint32_t move_pan_tilt_left(uint32_t pulsewidth_x_us);
-uint32_t move_pan_tilt_right(uint32_t pulsewidth_x_us);
-uint32_t move_pan_tilt_up(uint32_t pulsewidth_y_us);
-uint32_t move_pan_tilt_down(uint32_t pulsewidth_y_us);
+uint32_t joystick_step_us(uint32_t value);
+uint32_t move_pan_tilt_left(uint32_t pulsewidth_x_us, uint32_t step_us);
+uint32_t move_pan_tilt_right(uint32_t pulsewidth_x_us, uint32_t step_us);
+uint32_t move_pan_tilt_up(uint32_t pulsewidth_y_us, uint32_t step_us);
+uint32_t move_pan_tilt_down(uint32_t pulsewidth_y_us, uint32_t step_us);
+void send_servo();
+void send_wave();
+void apply_pan_tilt();
 void move_pan_tilt();
 void setup_joystick();
 void setup_pwm();
+void setup_wave();
 void initialize_pigpio();
 void cleanup();
 void int_handler(int signum);
 void joystick_button_isr(int gpio, int level, uint32_t tick);
 uint32_t button_press_operation();
 bool handle_button_press();
+bool handle_sweep_command(const char *line);
+void run_sweep();
+uint64_t trace_now_us();
+void trace_record(struct trace_buffer_t *buffer, const char *name, uint64_t start_us, uint64_t end_us);
+void trace_write_buffer(FILE *f, struct trace_buffer_t *buffer);
+void trace_write();
 
 /*
  * read_joystick_x
@@ -308,13 +399,36 @@ bool is_joystick_full_down(struct joystick_t joystick) {
     return is_joystick_down(joystick) && !is_joystick_left(joystick) && !is_joystick_right(joystick);
 }
 
+/*
+ * joystick_step_us
+ *
+ * Returns the pulsewidth step for a joystick axis value past its threshold.
+ * In wave output, the step grows from PWM_WAVE_STEP_MIN_US at the threshold
+ * to PWM_PULSEWIDTH_STEP_US at the end of the axis, for fine positioning.
+ * gpioServo() outputs always move by PWM_PULSEWIDTH_STEP_US.
+ */
+uint32_t joystick_step_us(uint32_t value) {
+    if (output != OUTPUT_WAVE) {
+        return PWM_PULSEWIDTH_STEP_US;
+    }
+
+    uint32_t deflection = (value < JOYSTICK_MIDDLE) ? JOYSTICK_MIDDLE - value : value - JOYSTICK_MIDDLE;
+    uint32_t threshold = JOYSTICK_MIDDLE - JOYSTICK_DEC_THRES;
+    if (deflection <= threshold) {
+        return PWM_WAVE_STEP_MIN_US;
+    }
+
+    uint32_t step_us = PWM_WAVE_STEP_MIN_US + ((PWM_PULSEWIDTH_STEP_US - PWM_WAVE_STEP_MIN_US) * (deflection - threshold)) / (JOYSTICK_MIDDLE - threshold);
+    return (step_us < PWM_PULSEWIDTH_STEP_US) ? step_us : PWM_PULSEWIDTH_STEP_US;
+}
+
 /*
  * move_pan_tilt_left
  *
  * Returns the updated horizontal position of the pan-tilt module.
  */
-uint32_t move_pan_tilt_left(uint32_t pulsewidth_x_us) {
-    return pulsewidth_x_us += PWM_PULSEWIDTH_STEP_US;
+uint32_t move_pan_tilt_left(uint32_t pulsewidth_x_us, uint32_t step_us) {
+    return pulsewidth_x_us += step_us;
 }
 
 /*
@@ -322,8 +436,8 @@ uint32_t move_pan_tilt_left(uint32_t pulsewidth_x_us) {
  *
  * Returns the updated horizontal position of the pan-tilt module.
  */
-uint32_t move_pan_tilt_right(uint32_t pulsewidth_x_us) {
-    return pulsewidth_x_us -= PWM_PULSEWIDTH_STEP_US;
+uint32_t move_pan_tilt_right(uint32_t pulsewidth_x_us, uint32_t step_us) {
+    return pulsewidth_x_us -= step_us;
 }
 
 /*
@@ -331,8 +445,8 @@ uint32_t move_pan_tilt_right(uint32_t pulsewidth_x_us) {
  *
  * Returns the updated vertical position of the pan-tilt module.
  */
-uint32_t move_pan_tilt_up(uint32_t pulsewidth_y_us) {
-    return pulsewidth_y_us -= PWM_PULSEWIDTH_STEP_US;
+uint32_t move_pan_tilt_up(uint32_t pulsewidth_y_us, uint32_t step_us) {
+    return pulsewidth_y_us -= step_us;
 }
 
 /*
@@ -340,33 +454,109 @@ uint32_t move_pan_tilt_up(uint32_t pulsewidth_y_us) {
  *
  * Returns the updated vertical position of the pan-tilt module.
  */
-uint32_t move_pan_tilt_down(uint32_t pulsewidth_y_us) {
-    return pulsewidth_y_us += PWM_PULSEWIDTH_STEP_US;
+uint32_t move_pan_tilt_down(uint32_t pulsewidth_y_us, uint32_t step_us) {
+    return pulsewidth_y_us += step_us;
 }
 
 /*
- * move_pan_tilt
+ * send_servo
  *
- * Moving engine left is done by increasing pulsewidth, and moving engine right
- * is done by decreasing pulsewidth
+ * Sends the pulsewidths to the servos as two independent gpioServo() outputs.
+ * Each output switches to its new pulsewidth in its own servo frame.
  */
-void move_pan_tilt() {
-    static uint32_t pulsewidth_x_us = PWM_PULSEWIDTH_INIT_US;
-    static uint32_t pulsewidth_y_us = PWM_PULSEWIDTH_INIT_US;
+void send_servo() {
+    /* set PWM x */
+    if (gpioServo(PWM_GPIO_PIN_X, pulsewidth_x_us) != 0) {
+        printf("Error: gpioServo() failed for PWM_GPIO_PIN_X\n");
+        exit(EXIT_FAILURE);
+    }
 
-    struct joystick_t joystick = read_joystick();
+    /* set PWM y */
+    if (gpioServo(PWM_GPIO_PIN_Y, pulsewidth_y_us) != 0) {
+        printf("Error: gpioServo() failed for PWM_GPIO_PIN_Y\n");
+        exit(EXIT_FAILURE);
+    }
+}
 
-    /* update x & y */
-    if (is_joystick_full_left(joystick)) { /* update x */
-        pulsewidth_x_us = move_pan_tilt_left(pulsewidth_x_us);
-    } else if (is_joystick_full_right(joystick)) {
-        pulsewidth_x_us = move_pan_tilt_right(pulsewidth_x_us);
-    } else if (is_joystick_full_up(joystick)) { /* update y */
-        pulsewidth_y_us = move_pan_tilt_up(pulsewidth_y_us);
-    } else if (is_joystick_full_down(joystick)) {
-        pulsewidth_y_us = move_pan_tilt_down(pulsewidth_y_us);
+/*
+ * send_wave
+ *
+ * Sends the pulsewidths to the servos as one DMA waveform of a whole servo
+ * frame, repeated until the next waveform: both pulses start at the beginning
+ * of the frame, and the next waveform only takes over at the end of a frame
+ * (PI_WAVE_MODE_REPEAT_SYNC), so both servos switch to their new pulsewidth
+ * at the same frame boundary. Nothing is sent if the pulsewidths didn't
+ * change.
+ */
+void send_wave() {
+    wave_switched = false;
+    if ((wave_id >= 0) && (pulsewidth_x_us == wave_x_us) && (pulsewidth_y_us == wave_y_us)) {
+        return;
+    }
+
+    uint32_t bit_x = 1 << PWM_GPIO_PIN_X;
+    uint32_t bit_y = 1 << PWM_GPIO_PIN_Y;
+
+    /* both pulses rise together, the shorter one falls first */
+    uint32_t short_us = pulsewidth_x_us;
+    uint32_t long_us = pulsewidth_y_us;
+    uint32_t bit_short = bit_x;
+    uint32_t bit_long = bit_y;
+    if (pulsewidth_y_us < pulsewidth_x_us) {
+        short_us = pulsewidth_y_us;
+        long_us = pulsewidth_x_us;
+        bit_short = bit_y;
+        bit_long = bit_x;
     }
 
+    gpioPulse_t pulses[3];
+    uint32_t num_pulses = 0;
+    pulses[num_pulses++] = (gpioPulse_t) {bit_x | bit_y, 0, short_us};
+    if (short_us < long_us) {
+        pulses[num_pulses++] = (gpioPulse_t) {0, bit_short, long_us - short_us};
+        pulses[num_pulses++] = (gpioPulse_t) {0, bit_long, PWM_GPIO_RANGE_US - long_us};
+    } else {
+        pulses[num_pulses++] = (gpioPulse_t) {0, bit_x | bit_y, PWM_GPIO_RANGE_US - long_us};
+    }
+
+    if (gpioWaveAddGeneric(num_pulses, pulses) < 0) {
+        printf("Error: gpioWaveAddGeneric() failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    int new_wave_id = gpioWaveCreate();
+    if (new_wave_id < 0) {
+        printf("Error: gpioWaveCreate() failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (gpioWaveTxSend(new_wave_id, PI_WAVE_MODE_REPEAT_SYNC) < 0) {
+        printf("Error: gpioWaveTxSend() failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* the previous waveform can only be deleted once the new one has taken
+       over, at the end of the current frame */
+    if (wave_id >= 0) {
+        while (gpioWaveTxAt() != new_wave_id) {
+            usleep(PWM_WAVE_POLL_US);
+        }
+        gpioWaveDelete(wave_id);
+        wave_switched = true;
+    }
+
+    wave_id = new_wave_id;
+    wave_x_us = pulsewidth_x_us;
+    wave_y_us = pulsewidth_y_us;
+}
+
+/*
+ * apply_pan_tilt
+ *
+ * Bounds the pulsewidths to the range of the servos and sends them to the
+ * servos.
+ */
+void apply_pan_tilt() {
     /* bound x */
     if (pulsewidth_x_us <= PWM_PULSEWIDTH_MIN_US) {
         pulsewidth_x_us = PWM_PULSEWIDTH_MIN_US;
@@ -381,17 +571,34 @@ void move_pan_tilt() {
         pulsewidth_y_us = PWM_PULSEWIDTH_MAX_US;
     }
 
-    /* set PWM x */
-    if (gpioServo(PWM_GPIO_PIN_X, pulsewidth_x_us) != 0) {
-        printf("Error: gpioServo() failed for PWM_GPIO_PIN_X\n");
-        exit(EXIT_FAILURE);
+    if (output == OUTPUT_WAVE) {
+        send_wave();
+    } else {
+        send_servo();
     }
+}
 
-    /* set PWM y */
-    if (gpioServo(PWM_GPIO_PIN_Y, pulsewidth_y_us) != 0) {
-        printf("Error: gpioServo() failed for PWM_GPIO_PIN_Y\n");
-        exit(EXIT_FAILURE);
+/*
+ * move_pan_tilt
+ *
+ * Moving engine left is done by increasing pulsewidth, and moving engine right
+ * is done by decreasing pulsewidth
+ */
+void move_pan_tilt() {
+    struct joystick_t joystick = read_joystick();
+
+    /* update x & y */
+    if (is_joystick_full_left(joystick)) { /* update x */
+        pulsewidth_x_us = move_pan_tilt_left(pulsewidth_x_us, joystick_step_us(joystick.x));
+    } else if (is_joystick_full_right(joystick)) {
+        pulsewidth_x_us = move_pan_tilt_right(pulsewidth_x_us, joystick_step_us(joystick.x));
+    } else if (is_joystick_full_up(joystick)) { /* update y */
+        pulsewidth_y_us = move_pan_tilt_up(pulsewidth_y_us, joystick_step_us(joystick.y));
+    } else if (is_joystick_full_down(joystick)) {
+        pulsewidth_y_us = move_pan_tilt_down(pulsewidth_y_us, joystick_step_us(joystick.y));
     }
+
+    apply_pan_tilt();
 }
 
 /*
@@ -455,6 +662,28 @@ void setup_pwm() {
     }
 }
 
+/*
+ * setup_wave
+ *
+ * - Sets the servo pins as outputs driven by the waveforms
+ * - Clears the waveforms left over by a previous run
+ */
+void setup_wave() {
+    if (gpioSetMode(PWM_GPIO_PIN_X, PI_OUTPUT) != 0) {
+        printf("Error: gpioSetMode() failed for PWM_GPIO_PIN_X\n");
+        exit(EXIT_FAILURE);
+    }
+    if (gpioSetMode(PWM_GPIO_PIN_Y, PI_OUTPUT) != 0) {
+        printf("Error: gpioSetMode() failed for PWM_GPIO_PIN_Y\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (gpioWaveClear() != 0) {
+        printf("Error: gpioWaveClear() failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
 /*
  * initialize_pigpio
  *
@@ -473,6 +702,8 @@ void initialize_pigpio() {
  * Cleans up all open file handles.
  */
 void cleanup() {
+    trace_write();
+
     if (spiClose(fd_spi) != 0) {
         printf("Error: spiClose() failed\n");
         exit(EXIT_FAILURE);
@@ -498,6 +729,7 @@ void int_handler(int signum) {
  */
 void joystick_button_isr(int gpio, int level, uint32_t tick) {
     joystick_button_pressed = true;
+    trace_record(&trace_isr, "button press", trace_now_us(), 0);
 }
 
 /*
@@ -506,6 +738,8 @@ void joystick_button_isr(int gpio, int level, uint32_t tick) {
  * Returns the operation selected by the joystick.
  *   - left  -> OP_SKIN_SMOOTHING
  *   - right -> OP_SHADOW_DETECTION
+ *   - up    -> OP_ALL (every operation, from the same registration)
+ *   - down  -> OP_DEHAZING
  */
 uint32_t button_press_operation() {
     struct joystick_t joystick = read_joystick();
@@ -515,6 +749,10 @@ uint32_t button_press_operation() {
             return OP_SKIN_SMOOTHING;
         } else if (is_joystick_full_right(joystick)) {
             return OP_SHADOW_DETECTION;
+        } else if (is_joystick_full_up(joystick)) {
+            return OP_ALL;
+        } else if (is_joystick_full_down(joystick)) {
+            return OP_DEHAZING;
         }
 
         joystick = read_joystick();
@@ -524,7 +762,8 @@ uint32_t button_press_operation() {
 /*
  * handle_button_press
  *
- * If a button press has occurred, then print the operation on stdout to
+ * If a button press has occurred, then print the operation and the pose of
+ * the pan-tilt module (horizontal and vertical pulsewidths) on stdout to
  * inform the control program of the event, and return true. Otherwise, return
  * false.
  */
@@ -534,13 +773,19 @@ bool handle_button_press() {
         joystick_button_pressed = false;
 
         /* choose operation to send to calling process */
+        uint64_t start_us = trace_now_us();
         uint32_t operation = button_press_operation();
+        trace_record(&trace_main, "select operation", start_us, trace_now_us());
 
         /* send data to stdout (calling process will retrieve and process it) */
         if (operation == OP_SKIN_SMOOTHING) {
-            printf("%s", OP_SKIN_SMOOTHING_STR);
+            printf("%s %" PRIu32 " %" PRIu32, OP_SKIN_SMOOTHING_STR, pulsewidth_x_us, pulsewidth_y_us);
         } else if (operation == OP_SHADOW_DETECTION) {
-            printf("%s", OP_SHADOW_DETECTION_STR);
+            printf("%s %" PRIu32 " %" PRIu32, OP_SHADOW_DETECTION_STR, pulsewidth_x_us, pulsewidth_y_us);
+        } else if (operation == OP_ALL) {
+            printf("%s %" PRIu32 " %" PRIu32, OP_ALL_STR, pulsewidth_x_us, pulsewidth_y_us);
+        } else if (operation == OP_DEHAZING) {
+            printf("%s %" PRIu32 " %" PRIu32, OP_DEHAZING_STR, pulsewidth_x_us, pulsewidth_y_us);
         }
 
         return true;
@@ -549,7 +794,144 @@ bool handle_button_press() {
     return false;
 }
 
+/*
+ * handle_sweep_command
+ *
+ * Executes a line of the sweep protocol read from stdin. Returns false once
+ * the sweep is over.
+ */
+bool handle_sweep_command(const char *line) {
+    uint32_t pan_us = 0;
+    uint32_t tilt_us = 0;
+
+    if (sscanf(line, "MOVE %" SCNu32 " %" SCNu32, &pan_us, &tilt_us) == 2) {
+        uint64_t start_us = trace_now_us();
+        pulsewidth_x_us = pan_us;
+        pulsewidth_y_us = tilt_us;
+        apply_pan_tilt();
+
+        /* wait for the servos to settle before the capture */
+        usleep(SWEEP_SETTLE_US);
+        trace_record(&trace_main, "sweep move", start_us, trace_now_us());
+
+        /* acknowledge with the pose actually applied (after bounding) */
+        printf("POSE %" PRIu32 " %" PRIu32 "\n", pulsewidth_x_us, pulsewidth_y_us);
+        fflush(stdout);
+        return true;
+    }
+
+    if (strncmp(line, "END", 3) == 0) {
+        return false;
+    }
+
+    fprintf(stderr, "Error: unknown sweep command: %s", line);
+    return true;
+}
+
+/*
+ * run_sweep
+ *
+ * Moves the pan-tilt module to the poses read from stdin until the end of the
+ * sweep.
+ */
+void run_sweep() {
+    char line[SWEEP_LINE_MAX];
+
+    apply_pan_tilt();
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        if (!handle_sweep_command(line)) {
+            break;
+        }
+    }
+}
+
+/*
+ * trace_now_us
+ *
+ * Returns the current time in microseconds, in the system clock that ptpd
+ * keeps synchronized between the units.
+ */
+uint64_t trace_now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return ((uint64_t) now.tv_sec) * 1000000 + now.tv_nsec / 1000;
+}
+
+/*
+ * trace_record
+ *
+ * Records an event in the buffer of the calling thread if tracing is enabled.
+ * Events are dropped once the buffer is full.
+ */
+void trace_record(struct trace_buffer_t *buffer, const char *name, uint64_t start_us, uint64_t end_us) {
+    if (trace_file == NULL) {
+        return;
+    }
+
+    if (buffer->count == TRACE_MAX_EVENTS) {
+        buffer->dropped++;
+        return;
+    }
+
+    struct trace_event_t *event = &buffer->events[buffer->count];
+    event->name = name;
+    event->start_us = start_us;
+    event->end_us = end_us;
+    buffer->count++;
+}
+
+/*
+ * trace_write_buffer
+ *
+ * Writes the events of a buffer as Chrome trace events.
+ */
+void trace_write_buffer(FILE *f, struct trace_buffer_t *buffer) {
+    fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %" PRIu32 ", \"args\": {\"name\": \"%s\", \"dropped\": %" PRIu32 "}}",
+            getpid(), buffer->tid, buffer->thread_name, buffer->dropped);
+
+    for (uint32_t i = 0; i < buffer->count; i++) {
+        struct trace_event_t *event = &buffer->events[i];
+        if (event->end_us == 0) {
+            fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"pan-tilt\", \"ph\": \"i\", \"s\": \"t\", \"pid\": %d, \"tid\": %" PRIu32 ", \"ts\": %" PRIu64 "}",
+                    event->name, getpid(), buffer->tid, event->start_us);
+        } else {
+            fprintf(f, ",\n{\"name\": \"%s\", \"cat\": \"pan-tilt\", \"ph\": \"X\", \"pid\": %d, \"tid\": %" PRIu32 ", \"ts\": %" PRIu64 ", \"dur\": %" PRIu64 "}",
+                    event->name, getpid(), buffer->tid, event->start_us, event->end_us - event->start_us);
+        }
+    }
+}
+
+/*
+ * trace_write
+ *
+ * Writes the recorded events to the trace file, if tracing is enabled.
+ */
+void trace_write() {
+    if (trace_file == NULL) {
+        return;
+    }
+
+    FILE *f = fopen(trace_file, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Error: cannot open trace file %s\n", trace_file);
+        return;
+    }
+
+    fprintf(f, "[{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": 0, \"args\": {\"name\": \"pan-tilt\"}}", getpid());
+    trace_write_buffer(f, &trace_main);
+    trace_write_buffer(f, &trace_isr);
+    fprintf(f, "\n]\n");
+    fclose(f);
+}
+
 int main(int argc, char **argv) {
+    trace_file = getenv(TRACE_FILE_ENV);
+
+    const char *output_name = getenv(OUTPUT_ENV);
+    if ((output_name != NULL) && (strcmp(output_name, OUTPUT_WAVE_STR) == 0)) {
+        output = OUTPUT_WAVE;
+    }
+
     initialize_pigpio();
 
     /* register signal handler for SIGINT (ctrl+c) */
@@ -559,15 +941,36 @@ int main(int argc, char **argv) {
     }
 
     setup_joystick();
-    setup_pwm();
+    if (output == OUTPUT_WAVE) {
+        setup_wave();
+    } else {
+        setup_pwm();
+    }
+
+    if ((argc > 1) && (strcmp(argv[1], SWEEP_ARG) == 0)) {
+        run_sweep();
+        cleanup();
+        return EXIT_SUCCESS;
+    }
 
     bool button_press_handled = false;
     while (!button_press_handled) {
+        uint64_t start_us = trace_now_us();
         button_press_handled = handle_button_press();
+        if (button_press_handled) {
+            /* the pose reported with the operation is the one the capture is
+               taken from: the servos don't move after it */
+            trace_record(&trace_main, "control loop", start_us, trace_now_us());
+            break;
+        }
         move_pan_tilt();
+        trace_record(&trace_main, "control loop", start_us, trace_now_us());
 
-        /* sleep for some time to avoid the servo from moving too fast */
-        usleep(USLEEP_DELAY);
+        /* sleep for some time to avoid the servo from moving too fast (a new
+           waveform already waited for the end of a servo frame) */
+        if (!wave_switched) {
+            usleep(USLEEP_DELAY);
+        }
     }
 
     cleanup();
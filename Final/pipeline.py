@@ -0,0 +1,188 @@
+import threading
+import time
+
+try:
+    import Queue as queue
+except ImportError:
+    import queue
+
+# maximum number of jobs waiting in front of each stage
+queue_depth = 2
+
+# marks the end of the jobs
+end = object()
+
+
+class Job(object):
+    """
+    One capture going through a pipeline. sources are the data given by the
+    producer, frames the graph frames computed by the stages so far, which
+    are released once the job has left the pipeline.
+    """
+
+    def __init__(self, index, sources, targets, preview_targets=()):
+        self.index = index
+        self.sources = sources
+        self.targets = targets
+        self.preview_targets = list(preview_targets)
+        self.frames = {}
+        self.error = None
+        self.on_release = []
+        self.submit_time = None
+        self.preview_time = None
+        self.done_time = None
+
+    def latencies(self):
+        # (preview, final) latencies since the job was submitted, None if
+        # not reached
+        def since_submit(t):
+            return t - self.submit_time if t is not None and self.submit_time is not None else None
+        return since_submit(self.preview_time), since_submit(self.done_time)
+
+    def data(self):
+        data = dict(self.sources)
+        for name, frame in self.frames.items():
+            data[name] = frame.data
+        return data
+
+    def add(self, results):
+        # keeps the frames computed by a stage; a frame the job already has
+        # (a target of an earlier stage, e.g. rgb or nir_registered) keeps
+        # its own, possibly pooled, buffer, the new one is released
+        for name, frame in results.items():
+            if name in self.frames:
+                frame.release()
+            else:
+                self.frames[name] = frame
+
+    def release(self):
+        for frame in self.frames.values():
+            frame.release()
+        self.frames = {}
+        for callback in self.on_release:
+            callback()
+        self.on_release = []
+
+
+def graph_stage(g, targets=None, branches=False):
+    """
+    Stage function running the nodes of graph g needed to compute targets
+    from what the job already has. Without targets, the job's own targets
+    are used (typically for the last stage). With branches, the independent
+    branches of the graph are run concurrently.
+    """
+    def run(job):
+        wanted = job.targets if targets is None else targets
+        wanted = [target for target in wanted if target not in job.frames]
+        if branches:
+            results = g.run_branches(wanted, job.data())
+        else:
+            results = g.run(wanted, job.data())
+        job.add(results)
+        return job
+    return run
+
+
+def preview_stage(g):
+    """
+    Stage function computing the preview targets of the job (typically
+    from reduced images) and recording when the preview is ready.
+    """
+    def run(job):
+        results = g.run(job.preview_targets, job.data())
+        job.add(results)
+        job.preview_time = time.time()
+        return job
+    return run
+
+
+class Stage(object):
+
+    def __init__(self, name, function, input, output):
+        self.name = name
+        self.function = function
+        self.input = input
+        self.output = output
+        self.busy_time = 0.0
+        self.jobs = 0
+        self.depth_sum = 0
+        self.depth_max = 0
+        self.thread = threading.Thread(target=self.work, name=name)
+        self.thread.daemon = True
+
+    def work(self):
+        while True:
+            job = self.input.get()
+            if job is end:
+                self.output.put(end)
+                return
+
+            # queue depth seen by this stage, including the job just taken
+            depth = self.input.qsize() + 1
+            self.depth_sum += depth
+            self.depth_max = max(self.depth_max, depth)
+
+            if job.error is None:
+                start = time.time()
+                try:
+                    job = self.function(job)
+                except Exception as e:
+                    job.error = (self.name, e)
+                self.busy_time += time.time() - start
+            self.jobs += 1
+
+            self.output.put(job)
+
+
+class Pipeline(object):
+    """
+    Stage-parallel executor: every stage runs on its own thread and stages
+    are connected by bounded queues, so consecutive jobs are processed by
+    different stages at the same time (most of the time is spent in OpenCV
+    and numpy, which release the GIL). The throughput is then bounded by
+    the slowest stage instead of the sum of all stages.
+
+    stages is a list of (name, function) where function takes a Job and
+    returns it.
+    """
+
+    def __init__(self, stages, depth=queue_depth):
+        self.queues = [queue.Queue(depth) for _ in range(len(stages))]
+        self.queues.append(queue.Queue())
+        self.stages = []
+        for i, (name, function) in enumerate(stages):
+            self.stages.append(Stage(name, function, self.queues[i], self.queues[i + 1]))
+        self.start_time = time.time()
+        self.end_time = None
+        for stage in self.stages:
+            stage.thread.start()
+
+    def submit(self, job):
+        # blocks while the first stage is busy and its queue is full
+        job.submit_time = time.time()
+        self.queues[0].put(job)
+
+    def close(self):
+        # no more jobs will be submitted
+        self.queues[0].put(end)
+
+    def results(self):
+        # processed jobs, in submission order, until the pipeline is closed
+        while True:
+            job = self.queues[-1].get()
+            if job is end:
+                self.end_time = time.time()
+                return
+            job.done_time = time.time()
+            yield job
+
+    def stats(self):
+        # (name, jobs, busy time, utilisation, mean queue depth, max queue depth)
+        wall = (self.end_time or time.time()) - self.start_time
+        return [(s.name, s.jobs, s.busy_time, s.busy_time / wall if wall > 0 else 0.0,
+                 float(s.depth_sum) / s.jobs if s.jobs else 0.0, s.depth_max) for s in self.stages]
+
+    def print_stats(self):
+        for name, jobs, busy, utilisation, depth, depth_max in self.stats():
+            print('%-16s %3d jobs %8.3f s busy %5.1f %% utilisation, queue depth %.2f (max %d)'
+                  % (name, jobs, busy, 100 * utilisation, depth, depth_max))
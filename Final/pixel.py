@@ -0,0 +1,118 @@
+"""
+Pixel types of the processing kernels.
+
+Images are 8-bit (uint8), high bit depth (uint16) or float32 arrays with any
+number of channels. uint16 images are full scale: samples of fewer bits
+(e.g. the 10-bit raw data of the sensor) are shifted to the most significant
+bits when the frame enters the pipeline (full_scale), so that the kernels
+only depend on the array type and no precision is lost. float32 images are
+in [0, 1].
+
+The kernels below are implemented once per pixel type, in the OpenCV
+function supporting that type natively when there is one, and selected
+from the type of their input.
+"""
+
+import cv2
+import numpy
+
+# largest value of every integer pixel type, float images are in [0, 1]
+maxima = {numpy.dtype(numpy.uint8): 255, numpy.dtype(numpy.uint16): 65535, numpy.dtype(numpy.float32): 1.0}
+
+def maximum(dtype):
+    return maxima[numpy.dtype(dtype)]
+
+def full_scale(image, bits):
+    # shifts bits-bit samples stored in uint16 to full scale
+    if image.dtype != numpy.uint16 or bits >= 16:
+        return image
+    return numpy.left_shift(image, 16 - bits)
+
+def to_float(image):
+    # float32 image in [0, 1]
+    if image.dtype == numpy.float32:
+        return image
+    result = image.astype(numpy.float32)
+    result *= numpy.float32(1.0 / maximum(image.dtype))
+    return result
+
+def from_float(image, dtype, dst=None):
+    # converts a float32 image in [0, 1] to dtype, rounded and saturated
+    if numpy.dtype(dtype) == numpy.float32:
+        result = numpy.clip(image, 0, 1)
+    else:
+        result = image * maximum(dtype)
+        numpy.rint(result, out=result)
+        numpy.clip(result, 0, maximum(dtype), out=result)
+        if dst is not None:
+            dst[...] = result
+            return dst
+        result = result.astype(dtype)
+    if dst is not None:
+        dst[...] = result
+        return dst
+    return result
+
+def to_uint8(image):
+    # 8-bit copy, e.g. for the OpenCV functions only supporting 8-bit images
+    if image.dtype == numpy.uint8:
+        return image
+    if image.dtype == numpy.uint16:
+        return numpy.right_shift(image, 8).astype(numpy.uint8)
+    return from_float(image, numpy.uint8)
+
+def psnr(output, reference):
+    # peak signal to noise ratio (dB) of an 8-bit image against a reference
+    error = numpy.mean((output.astype(numpy.float64) - reference.astype(numpy.float64)) ** 2)
+    if error == 0:
+        return float('inf')
+    return 10 * numpy.log10(255.0 ** 2 / error)
+
+def intensity(value, dtype):
+    # converts an intensity given for 8-bit images (e.g. a filter parameter)
+    # to the range of dtype
+    return value * maximum(dtype) / 255.0
+
+
+# Saturating arithmetic. OpenCV saturates to the range of uint8 and uint16;
+# float images are clipped to [0, 1].
+
+def add(a, b):
+    if isinstance(a, numpy.ndarray) and a.dtype == numpy.float32:
+        return numpy.clip(a + b, 0, 1).astype(numpy.float32)
+    return cv2.add(a, b)
+
+def subtract(a, b):
+    if isinstance(a, numpy.ndarray) and a.dtype == numpy.float32:
+        return numpy.clip(a - b, 0, 1).astype(numpy.float32)
+    return cv2.subtract(a, b)
+
+
+def bilateral_filter(image, d, sigma_color, sigma_space):
+    """
+    Bilateral filter of an image of any pixel type, sigma_color being given
+    for 8-bit images. OpenCV filters uint8 and float32 images natively;
+    uint16 images are filtered as float32 in their own range, which is
+    exact for 16-bit values.
+    """
+    if image.dtype == numpy.uint8:
+        return cv2.bilateralFilter(image, d, sigma_color, sigma_space)
+    if image.dtype == numpy.float32:
+        return cv2.bilateralFilter(image, d, intensity(sigma_color, numpy.float32), sigma_space)
+    filtered = cv2.bilateralFilter(image.astype(numpy.float32), d, intensity(sigma_color, image.dtype), sigma_space)
+    return numpy.clip(numpy.rint(filtered), 0, maximum(image.dtype)).astype(image.dtype)
+
+
+def histogram(image):
+    # histogram with one bin per value of an integer grayscale image
+    levels = maximum(image.dtype) + 1
+    return cv2.calcHist([image], [0], None, [levels], [0, levels]).ravel().astype(numpy.int64)
+
+def apply_table(image, table, dst=None):
+    # maps every pixel of an integer image through a lookup table with one
+    # entry per value (cv2.LUT only supports 8-bit images)
+    if image.dtype == numpy.uint8:
+        if dst is None:
+            return cv2.LUT(image, table)
+        return cv2.LUT(image, table, dst=dst)
+    return numpy.take(table, image, out=dst)
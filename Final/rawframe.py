@@ -0,0 +1,301 @@
+"""
+Raw (unencoded) frames.
+
+A raw frame is a fixed-size header followed by the pixel data, laid out as
+the camera writes it (rows padded to the camera's stride). The same layout
+is used in memory, in files and on the network, so a frame captured into a
+mmap-ed FrameBuffer can be sent, stored or processed without any copy or
+decoding.
+"""
+
+import mmap
+import os
+import struct
+import time
+
+import cv2
+import numpy
+
+import pixel
+
+# pixel formats
+FORMAT_GRAY = 1    # one 8-bit plane
+FORMAT_BGR = 2     # interleaved 8-bit B, G, R (OpenCV order)
+FORMAT_RGB = 3     # interleaved 8-bit R, G, B
+FORMAT_YUV420 = 4  # planar Y, U, V (I420), the image is the Y (luma) plane
+FORMAT_RGBN = 5    # one plane of the 2x2 mosaic of an RGB-NIR sensor (demosaic.py)
+
+format_names = {FORMAT_GRAY: 'gray', FORMAT_BGR: 'bgr', FORMAT_RGB: 'rgb', FORMAT_YUV420: 'yuv', FORMAT_RGBN: 'rgbn'}
+format_channels = {FORMAT_GRAY: 1, FORMAT_BGR: 3, FORMAT_RGB: 3, FORMAT_YUV420: 1, FORMAT_RGBN: 1}
+
+# header: magic, version, header size, format, channels, bits per sample,
+# width, height, stride (bytes per row), rows (padded height), timestamp,
+# payload size, padded to header_size bytes so that the pixels are aligned
+magic = b'NIRF'
+version = 1
+header_size = 64
+header_struct = struct.Struct('<4sHHHHHxxIIIIdQ')
+
+# the camera pads the rows to 32 pixels and the height to 16 rows
+camera_width_alignment = 32
+camera_height_alignment = 16
+
+
+def align(value, alignment):
+    return (value + alignment - 1) // alignment * alignment
+
+
+class Header(object):
+
+    def __init__(self, width, height, format, bits=8, stride=None, rows=None, timestamp=0.0):
+        self.width = width
+        self.height = height
+        self.format = format
+        self.channels = format_channels[format]
+        self.bits = bits
+        sample_bytes = 1 if bits <= 8 else 2
+        self.stride = stride if stride is not None else align(width, camera_width_alignment) * self.channels * sample_bytes
+        self.rows = rows if rows is not None else align(height, camera_height_alignment)
+        self.timestamp = timestamp
+
+    def payload_size(self):
+        size = self.stride * self.rows
+        if self.format == FORMAT_YUV420:
+            # two chroma planes of half the width and height
+            size += 2 * (self.stride // 2) * (self.rows // 2)
+        return size
+
+    def dtype(self):
+        return numpy.uint8 if self.bits <= 8 else numpy.dtype('<u2')
+
+    def pack(self):
+        packed = header_struct.pack(magic, version, header_size, self.format, self.channels, self.bits,
+                                    self.width, self.height, self.stride, self.rows,
+                                    self.timestamp, self.payload_size())
+        return packed + b'\0' * (header_size - len(packed))
+
+    @classmethod
+    def unpack(cls, data):
+        (frame_magic, frame_version, size, format, channels, bits,
+         width, height, stride, rows, timestamp, payload_size) = header_struct.unpack_from(data)
+        if frame_magic != magic:
+            raise ValueError('not a raw frame')
+        if frame_version != version or size != header_size:
+            raise ValueError('unsupported raw frame version %d' % frame_version)
+        header = cls(width, height, format, bits, stride, rows, timestamp)
+        if header.payload_size() != payload_size:
+            raise ValueError('inconsistent raw frame header')
+        return header
+
+    def same_layout(self, other):
+        return (self.width, self.height, self.format, self.bits, self.stride, self.rows) == \
+            (other.width, other.height, other.format, other.bits, other.stride, other.rows)
+
+
+class RawFrame(object):
+    """
+    Header and pixel data of a frame. payload is a flat uint8 array (possibly
+    a view on a mmap) and image() a view of its visible pixels.
+    """
+
+    def __init__(self, header, payload):
+        self.header = header
+        self.payload = payload
+
+    def image(self):
+        h = self.header
+        dtype = h.dtype()
+        itemsize = numpy.dtype(dtype).itemsize
+        plane = self.payload[:h.stride * h.rows].view(dtype)
+        plane = plane.reshape(h.rows, h.stride // itemsize)
+        if h.channels == 1:
+            return plane[:h.height, :h.width]
+        return plane.reshape(h.rows, h.stride // (itemsize * h.channels), h.channels)[:h.height, :h.width]
+
+    def pixels(self):
+        # image() as processed by the pipeline: a view for 8-bit frames, a
+        # full scale uint16 copy for high bit depth frames (e.g. 10-bit raw
+        # data of the sensor)
+        return pixel.full_scale(self.image(), self.header.bits)
+
+
+class FrameBuffer(object):
+    """
+    Preallocated frame, mmap-ed from filename (e.g. in /dev/shm, so other
+    processes can map it too) or anonymous. The camera captures into
+    capture_target(), which is the payload of the frame.
+    """
+
+    def __init__(self, width, height, format, bits=8, filename=None):
+        self.header = Header(width, height, format, bits)
+        size = header_size + self.header.payload_size()
+        if filename is not None:
+            fd = os.open(filename, os.O_RDWR | os.O_CREAT | os.O_TRUNC, 0o644)
+            try:
+                os.ftruncate(fd, size)
+                self.map = mmap.mmap(fd, size)
+            finally:
+                os.close(fd)
+        else:
+            self.map = mmap.mmap(-1, size)
+        self.filename = filename
+        self.payload = numpy.frombuffer(self.map, numpy.uint8, self.header.payload_size(), header_size)
+        self.update_header()
+
+    def update_header(self, timestamp=None):
+        if timestamp is not None:
+            self.header.timestamp = timestamp
+        self.map[:header_size] = self.header.pack()
+
+    def capture_target(self):
+        return self.payload
+
+    def picamera_format(self):
+        return format_names[self.header.format]
+
+    def frame(self):
+        return RawFrame(self.header, self.payload)
+
+    def image(self):
+        return self.frame().image()
+
+    def pixels(self):
+        return self.frame().pixels()
+
+    def close(self):
+        self.payload = None
+        self.map.close()
+
+
+def from_buffer(data, offset=0):
+    # frame stored at offset in data (e.g. a mmap), without copying the pixels
+    header = Header.unpack(data[offset:offset + header_size])
+    payload = numpy.frombuffer(data, numpy.uint8, header.payload_size(), offset + header_size)
+    return RawFrame(header, payload)
+
+def is_raw_frame(data, offset=0):
+    return data[offset:offset + len(magic)] == magic
+
+def frame_size(frame):
+    # bytes taken by the frame in a file or on the network
+    return header_size + frame.header.payload_size()
+
+def read(filename):
+    # maps a raw frame file (read-only, the pixels are not copied)
+    with open(filename, 'rb') as f:
+        data = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+    return from_buffer(data)
+
+def write(filename, frame):
+    with open(filename, 'wb') as f:
+        f.write(frame.header.pack())
+        f.write(memoryview(frame.payload))
+
+def send(sock, frame):
+    sock.sendall(frame.header.pack())
+    sock.sendall(memoryview(frame.payload))
+
+def receive_exactly(sock, view):
+    received = 0
+    while received < len(view):
+        count = sock.recv_into(view[received:])
+        if count == 0:
+            raise IOError('connection closed while receiving a frame')
+        received += count
+
+def receive(sock, buffer=None):
+    """
+    Receives a frame into buffer (a FrameBuffer with the same layout) or into
+    a newly allocated one, and returns the buffer.
+    """
+    data = bytearray(header_size)
+    receive_exactly(sock, memoryview(data))
+    header = Header.unpack(bytes(data))
+
+    if buffer is None or not buffer.header.same_layout(header):
+        buffer = FrameBuffer(header.width, header.height, header.format, header.bits)
+    receive_exactly(sock, memoryview(buffer.payload))
+    buffer.update_header(header.timestamp)
+    return buffer
+
+def fill(frame, image):
+    """
+    Writes an image (BGR or grayscale, as decoded by OpenCV) into the frame
+    in the frame's format and layout, as the camera would.
+    """
+    h = frame.header
+    image = cv2.resize(image, (h.width, h.height)) if image.shape[:2] != (h.height, h.width) else image
+
+    if h.format == FORMAT_YUV420:
+        if image.ndim == 2:
+            image = cv2.cvtColor(image, cv2.COLOR_GRAY2BGR)
+        yuv = cv2.cvtColor(image, cv2.COLOR_BGR2YUV_I420)
+        payload = frame.payload
+        y_size = h.stride * h.rows
+        c_stride = h.stride // 2
+        payload[:y_size].reshape(h.rows, h.stride)[:h.height, :h.width] = yuv[:h.height]
+        chroma = yuv[h.height:].reshape(2, h.height // 2, h.width // 2)
+        for i in range(2):
+            start = y_size + i * c_stride * (h.rows // 2)
+            plane = payload[start:start + c_stride * (h.rows // 2)].reshape(h.rows // 2, c_stride)
+            plane[:h.height // 2, :h.width // 2] = chroma[i]
+        return
+
+    if h.format == FORMAT_GRAY and image.ndim == 3:
+        image = cv2.cvtColor(image, cv2.COLOR_BGR2GRAY)
+    elif h.format == FORMAT_BGR and image.ndim == 2:
+        image = cv2.cvtColor(image, cv2.COLOR_GRAY2BGR)
+    elif h.format == FORMAT_RGB:
+        image = cv2.cvtColor(image, cv2.COLOR_GRAY2RGB if image.ndim == 2 else cv2.COLOR_BGR2RGB)
+    frame.image()[...] = image
+
+format_codes = dict((name, code) for code, name in format_names.items())
+
+class FileCamera(object):
+    """
+    Stand-in for picamera.PiCamera returning the content of an image file,
+    for testing the capture paths without the camera. Raw captures are
+    written with the same padding as the camera, for the resolution set.
+    A raw frame file (e.g. a mosaic written by demosaic.py) is returned as
+    is by the raw captures of its layout.
+    """
+
+    def __init__(self, image_file):
+        self.image_file = image_file
+        self.resolution = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, type, value, traceback):
+        return False
+
+    def start_preview(self):
+        pass
+
+    def stop_preview(self):
+        pass
+
+    def capture(self, output, format='jpeg'):
+        if format == 'jpeg':
+            with open(self.image_file, 'rb') as f:
+                data = f.read()
+            if hasattr(output, 'write'):
+                output.write(data)
+            else:
+                with open(output, 'wb') as f:
+                    f.write(data)
+        elif self.image_file.endswith('.raw'):
+            frame = read(self.image_file)
+            if frame.header.format != format_codes[format] or len(output) != frame.header.payload_size():
+                raise ValueError('%s is not a %s frame of the capture layout' % (self.image_file, format))
+            output[...] = frame.payload
+        else:
+            width, height = self.resolution
+            header = Header(width, height, format_codes[format])
+            fill(RawFrame(header, output), cv2.imread(self.image_file, cv2.IMREAD_COLOR))
+
+def capture(camera, buffer):
+    # captures a raw frame into a FrameBuffer and timestamps it
+    buffer.update_header(time.time())
+    camera.capture(buffer.capture_target(), buffer.picamera_format())
@@ -3,15 +3,30 @@ from PIL import Image
 import numpy
 import cv2
 
-def register(rgb, nir):
-	# Open image and convert it to byte images (instead of RGB)
+import pixel
+
+def read_image(image, mode=None):
+	# Open the image file, or use the image directly if it is already decoded
+	# (color images in memory are expected in RGB order, as PIL returns them)
+	if isinstance(image, str):
+		image = Image.open(image)
+		if mode is not None:
+			image = image.convert(mode)
+		return numpy.array(image)
+
+	if mode == "L" and image.ndim == 3:
+		return cv2.cvtColor(image, cv2.COLOR_RGB2GRAY)
+	return image
+
+def features(rgb, nir):
+	# Keypoints and descriptors of both images
 	# Array of arrays with pixel values 0-255
 	# First element (array) is all the pixels in trgbhe first row of the image (1024 px)
-	image1 = Image.open(rgb)
-	rgb = numpy.array(image1)
-
-	image2 = Image.open(nir)
-	nir = numpy.array(image2.convert("L"))
+	rgb = read_image(rgb)
+	nir = read_image(nir, "L")
+	# SIFT only detects features in 8-bit images
+	rgb = pixel.to_uint8(rgb)
+	nir = pixel.to_uint8(nir)
 
 	# Detect keypoint using SIFT
 	detectKP =cv2.SIFT(0, 3, 0.04, 30, 1.6)
@@ -27,6 +42,12 @@ def register(rgb, nir):
 	k1, des1 = extractor.compute(rgb, kp_rgb)
 	k2, des2 = extractor.compute(nir, kp_nir)
 
+	return k1, des1, k2, des2
+
+def find_homography(rgb, nir):
+	# Homography mapping the pixels of the first image on the second one
+	k1, des1, k2, des2 = features(rgb, nir)
+
 	# Nearest neighbor search, matching keypoints
 	FLANN_INDEX_KDTREE = 0
 	index_params = dict(algorithm = FLANN_INDEX_KDTREE, trees = 5)
@@ -48,8 +69,125 @@ def register(rgb, nir):
 
 	M, mask = cv2.findHomography(src_pts, dst_pts, cv2.RANSAC,3.0)
 
+	return M
+
+def scale_homography(M, scale):
+	# Homography of images scaled by scale, from the homography M of the
+	# original images
+	S = numpy.diag([scale, scale, 1.0])
+	return S.dot(M).dot(numpy.linalg.inv(S))
+
+def crop(image, window):
+	# Part of an image in an (x0, y0, x1, y1) window, None for the whole image
+	if window is None:
+		return image
+	x0, y0, x1, y1 = window
+	return image[y0:y1, x0:x1]
+
+def pairs_within(predicted, points, radius):
+	# (i1, i2) indices of the predicted positions and points closer than
+	# radius. The points are bucketed in a grid of radius sized cells, so
+	# only the points of the 3x3 cells around every predicted position are
+	# compared (memory linear in the number of candidates, instead of a
+	# distance matrix of all the pairs)
+	finite = numpy.isfinite(predicted).all(axis=1)
+	predicted = numpy.where(finite[:,None], predicted, 0)
+	cells = numpy.floor(points / radius).astype(numpy.int64)
+	origin = cells.min(axis=0)
+	cells -= origin
+	columns = cells[:,0].max() + 1
+	keys = cells[:,1] * columns + cells[:,0]
+	order = numpy.argsort(keys, kind='mergesort')
+	sorted_keys = keys[order]
+
+	centers = numpy.floor(predicted / radius).astype(numpy.int64) - origin
+	indices = numpy.arange(len(predicted))
+	i1 = []
+	i2 = []
+	for dy in (-1, 0, 1):
+		for dx in (-1, 0, 1):
+			x = centers[:,0] + dx
+			y = centers[:,1] + dy
+			key = y * columns + x
+			start = numpy.searchsorted(sorted_keys, key, 'left')
+			end = numpy.searchsorted(sorted_keys, key, 'right')
+			counts = numpy.where(finite & (x >= 0) & (x < columns) & (y >= 0), end - start, 0)
+			total = counts.sum()
+			if total == 0:
+				continue
+			offsets = numpy.arange(total) - numpy.repeat(numpy.cumsum(counts) - counts, counts)
+			i1.append(numpy.repeat(indices, counts))
+			i2.append(order[numpy.repeat(start, counts) + offsets])
+	if not i1:
+		return numpy.empty(0, numpy.int64), numpy.empty(0, numpy.int64)
+	i1 = numpy.concatenate(i1)
+	i2 = numpy.concatenate(i2)
+	close = numpy.hypot(predicted[i1,0] - points[i2,0], predicted[i1,1] - points[i2,1]) < radius
+	return i1[close], i2[close]
+
+def refine_homography(rgb, nir, prior, radius=8.0, windows=(None, None)):
+	# Homography mapping the first image on the second one, warm started
+	# from an approximate homography (e.g. found on smaller images): a
+	# keypoint of the first image is only matched with the keypoints of the
+	# second image within radius pixels of where the prior maps it, which
+	# rejects most wrong matches before the ratio test and RANSAC. If
+	# windows are given (e.g. the parts of the images the prior says
+	# overlap), keypoints are only detected inside them.
+	rgb = read_image(rgb)
+	nir = read_image(nir, "L")
+	k1, des1, k2, des2 = features(crop(rgb, windows[0]), crop(nir, windows[1]))
+	if des1 is None or des2 is None:
+		return prior
+
+	p1 = numpy.float32([ k.pt for k in k1 ]).reshape(-1,1,2)
+	p2 = numpy.float32([ k.pt for k in k2 ])
+	if windows[0] is not None:
+		p1 += numpy.float32(windows[0][:2])
+	if windows[1] is not None:
+		p2 += numpy.float32(windows[1][:2])
+	predicted = cv2.perspectiveTransform(p1, prior).reshape(-1,2)
+
+	# Candidate pairs close to the predicted positions
+	i1, i2 = pairs_within(predicted, p2, radius)
+	if len(i1) == 0:
+		return prior
+	descriptor_distance = numpy.sqrt(((des1[i1] - des2[i2]) ** 2).sum(axis=1))
+
+	# Best and second best candidate of every keypoint, and ratio test
+	order = numpy.lexsort((descriptor_distance, i1))
+	i1, i2, descriptor_distance = i1[order], i2[order], descriptor_distance[order]
+	first = numpy.ones(len(i1), bool)
+	first[1:] = i1[1:] != i1[:-1]
+	good = []
+	for j in numpy.nonzero(first)[0]:
+	    if j + 1 < len(i1) and i1[j + 1] == i1[j] and descriptor_distance[j] >= 0.7*descriptor_distance[j + 1]:
+	        continue
+	    good.append((i1[j], i2[j]))
+
+	print "number of good points: " + str(len(good))
+	if len(good) < 4:
+		return prior
+
+	src_pts = numpy.float32([ p1[a,0] for a, b in good ]).reshape(-1,1,2)
+	dst_pts = numpy.float32([ p2[b] for a, b in good ]).reshape(-1,1,2)
+
+	M, mask = cv2.findHomography(src_pts, dst_pts, cv2.RANSAC,3.0)
+	if M is None:
+		return prior
+
+	return M
+
+def warp(rgb, M, shape, dst=None):
 	# Warp source image to destination based on homography
-	im_out = cv2.warpPerspective(rgb, M, (nir.shape[1],nir.shape[0]))
+	return cv2.warpPerspective(rgb, M, (shape[1],shape[0]), dst=dst)
+
+def register(rgb, nir, dst=None):
+	# Open image and convert it to byte images (instead of RGB)
+	rgb = read_image(rgb)
+	nir = read_image(nir, "L")
+
+	M = find_homography(rgb, nir)
+	im_out = warp(rgb, M, nir.shape, dst)
 
 	return im_out
 
@@ -0,0 +1,184 @@
+#!/usr/bin/python2
+
+"""
+Replays the captures of an archive (archive.py) through the processing
+pipeline, as fast as it can process them and without any capture hardware,
+to reprocess them (e.g. with other parameters) or to benchmark the
+processing on the same input every time. With --cache, the intermediate
+frames are kept in a cache directory, so replaying again with another
+operation or other parameters only runs the stages affected.
+
+Raw frames are processed in place from the mapped archive. The homography
+recorded with a capture is used unless --register is given, and so are the
+parameters recorded with it, with the --set options applied on top.
+
+Usage:
+    ./replay.py <archive> [--output DIR] [--operation OP] [--register]
+                [--cache DIR] [--offload HOST[:PORT]] [--set merge.d=15] [--set shadow.tao=12]
+"""
+
+import argparse
+import os
+import threading
+import time
+
+import archive
+import cache
+import dehazing
+import offload
+import pipeline
+import shadow_detection
+import stages
+import tracing
+
+# constants (as in camera_client.py)
+op_skin_smoothing = 'OP_SKIN_SMOOTHING'
+op_shadow_detection = 'OP_SHADOW_DETECTION'
+op_dehazing = 'OP_DEHAZING'
+op_all = 'OP_ALL'
+nir_registered_image_file = 'nir_registered.jpg'
+skin_smoothing_image_file = 'skin_smoothing.jpg'
+shadow_detection_image_file = 'shadow_detection.png'
+dehazing_image_file = 'dehazing.jpg'
+
+
+def sources(record, register):
+    if record.is_raw():
+        # the nir image is the luma plane of the yuv frame
+        result = {stages.nir: record.nir.pixels(), stages.rgb: record.rgb.pixels(),
+                  stages.nir_raw: record.nir, stages.rgb_raw: record.rgb}
+    else:
+        result = {stages.nir_jpeg: record.nir, stages.rgb_jpeg: record.rgb}
+    result.update({stages.capture_index: record.index, stages.capture_time: record.timestamp,
+                   stages.pose: record.pose, stages.operation: record.meta.get('operation', '')})
+    if record.homography is not None and not register:
+        result[stages.homography] = record.homography
+    return result
+
+def set_parameter(assignment):
+    # applies a --set stage.name=value option
+    name, value = assignment.split('=', 1)
+    stage, name = name.split('.', 1)
+    if stage == 'merge' and name in stages.merge_parameters:
+        stages.merge_parameters[name] = type(stages.merge_parameters[name])(value)
+    elif stage == 'shadow' and name == 'scale':
+        stages.shadow_scale = int(value)
+    elif stage == 'shadow' and name in stages.shadow_parameters():
+        setattr(shadow_detection, name, type(getattr(shadow_detection, name))(value))
+    elif stage == 'dehazing' and name in stages.dehazing_parameters():
+        setattr(dehazing, name, type(getattr(dehazing, name))(value))
+    else:
+        raise ValueError('unknown parameter %s' % assignment)
+
+def recorded_parameters(record, defaults):
+    # parameters recorded with a capture, completed by the defaults for the
+    # ones older archives did not record
+    recorded = record.meta.get('parameters', {})
+    return dict((group, dict(values, **recorded.get(group, {}))) for group, values in defaults.items())
+
+def main():
+    parser = argparse.ArgumentParser(description='Replay the captures of an archive through the processing pipeline.')
+    parser.add_argument('archive')
+    parser.add_argument('--output', default='replay', help='output directory (default: %(default)s)')
+    parser.add_argument('--operation', help='operation applied to every capture instead of the recorded one')
+    parser.add_argument('--register', action='store_true', help='register the images again instead of using the recorded homography')
+    parser.add_argument('--preview', action='store_true', help='process a reduced copy of every capture first')
+    parser.add_argument('--cache', help='directory caching the intermediate frames between runs')
+    parser.add_argument('--offload', metavar='HOST[:PORT]', help='worker (offload.py) running registration and the operations when it is faster')
+    parser.add_argument('--set', action='append', default=[], metavar='STAGE.NAME=VALUE',
+                        help='sets a processing parameter (merge.d, merge.sigmaC, merge.sigmaS, shadow.tao, shadow.nabla, shadow.scale, dehazing.omega...)')
+    args = parser.parse_args()
+
+    defaults = stages.parameters()
+    for assignment in args.set:
+        set_parameter(assignment)
+
+    reader = archive.Reader(args.archive)
+    if not os.path.isdir(args.output):
+        os.makedirs(args.output)
+
+    def output(filename):
+        base, extension = os.path.splitext(filename)
+        return os.path.join(args.output, base + '_%03d' + extension)
+
+    frame_cache = cache.Cache(args.cache) if args.cache else None
+    raw = any(record.is_raw() for record in reader)
+    g = stages.build_graph(frame_cache=frame_cache, preview=args.preview, raw=raw)
+    common_targets = [stages.add_file_sink(g, stages.nir_registered, output(nir_registered_image_file))]
+    operation_targets = {
+        op_skin_smoothing: [stages.add_file_sink(g, stages.skin_smoothing, output(skin_smoothing_image_file))],
+        op_shadow_detection: [stages.add_file_sink(g, stages.shadow_detection_mask, output(shadow_detection_image_file))],
+        op_dehazing: [stages.add_file_sink(g, stages.dehazing_image, output(dehazing_image_file))],
+    }
+    operation_targets[op_all] = [target for targets in operation_targets.values() for target in targets]
+
+    preview_targets = {}
+    if args.preview:
+        scale = stages.preview_scale
+        coarse = [stages.scaled(stages.homography, scale)]
+        preview_targets = {
+            op_skin_smoothing: coarse + [stages.add_file_sink(g, stages.scaled(stages.skin_smoothing, scale), output('preview_' + skin_smoothing_image_file))],
+            op_shadow_detection: coarse + [stages.add_file_sink(g, stages.scaled(stages.shadow_detection_mask, scale), output('preview_' + shadow_detection_image_file))],
+            op_dehazing: coarse + [stages.add_file_sink(g, stages.scaled(stages.dehazing_image, scale), output('preview_' + dehazing_image_file))],
+        }
+        preview_targets[op_all] = coarse + [t for targets in preview_targets.values() for t in targets if t not in coarse]
+
+    offloader = offload.Offloader(args.offload, raw, args.preview) if args.offload else None
+    processing = pipeline.Pipeline(stages.pipeline_stages(g, args.preview, offloader))
+    start = time.time()
+
+    # the parameters are global to the stages: when the recorded ones change,
+    # the jobs in flight are finished before the new ones are applied
+    idle = threading.Condition()
+    in_flight = [0]
+
+    def produce():
+        applied = None
+        for record in reader:
+            parameters = recorded_parameters(record, defaults)
+            if parameters != applied:
+                with idle:
+                    while in_flight[0] > 0:
+                        idle.wait()
+                stages.set_parameters(parameters)
+                for assignment in args.set:
+                    set_parameter(assignment)
+                applied = parameters
+            operation = args.operation or record.meta.get('operation', '')
+            with idle:
+                in_flight[0] += 1
+            processing.submit(pipeline.Job(record.index, sources(record, args.register),
+                                           common_targets + operation_targets.get(operation, []),
+                                           preview_targets.get(operation, [])))
+        processing.close()
+
+    producer = threading.Thread(target=produce)
+    producer.daemon = True
+    producer.start()
+
+    failures = 0
+    for job in processing.results():
+        if job.error is not None:
+            print('Capture %d failed in stage %s: %s' % (job.index, job.error[0], job.error[1]))
+            failures += 1
+        preview_latency, final_latency = job.latencies()
+        if preview_latency is not None:
+            print('Capture %d: preview ready after %.3f s, final result after %.3f s' % (job.index, preview_latency, final_latency))
+        job.release()
+        with idle:
+            in_flight[0] -= 1
+            idle.notify()
+
+    elapsed = time.time() - start
+    print('%d captures replayed in %.3f s (%.2f captures/s), %d failed'
+          % (len(reader), elapsed, len(reader) / elapsed if elapsed > 0 else 0.0, failures))
+    g.print_timings()
+    processing.print_stats()
+    if offloader is not None:
+        offloader.print_stats()
+    if frame_cache is not None:
+        frame_cache.print_stats()
+    tracing.export()
+
+if __name__ == '__main__':
+    main()
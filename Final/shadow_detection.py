@@ -1,11 +1,32 @@
+import cv2
 import numpy as np
 from scipy import misc
 
+import guided_filter
+import pixel
+from shadow_mask import ShadowMask
+
 # Parameters for the non-linear mapping
 alpha = 14
 beta = 0.5
 gamma = 2.2
 
+# Tao is the parameter to upper bound the values t
+tao = 10
+# Nabla scales the number of bins of the shadow map histogram
+nabla = 1.6
+
+# Number of rows processed at once by shadowDetectionBands
+band_height = 64
+# Number of histogram sizes tried per pass while looking for the valley
+bins_per_pass = 8
+
+# Subsampling of shadowDetectionLowRes, and radius (in subsampled pixels)
+# and regularization of the guided filter upsampling its mask
+lowres_scale = 4
+upsampling_radius = 1
+upsampling_eps = 1e-3
+
 
 def nonlinearmapping(x):
     # This apply the non-linear mapping to x
@@ -19,38 +40,27 @@ def normalize(i):
     return (i - minim) / (maxim - minim)
 
 def im2double(i):
-    # Convert the image from uint8 to double
-    return i.astype('double') / 255
-
-def shadowDetection(rgb, nir):
-    # Perform the shadow detection algorithm to a pair of rgb and nir images
-
-    rgb = misc.imread(rgb)
-    nir = misc.imread(nir)
+    # Convert the image from its pixel type (uint8, uint16 or float32) to
+    # double in [0;1]
+    return i.astype('double') / pixel.maximum(i.dtype)
 
-    rgb = im2double(rgb)
-    nir = im2double(nir)
-
-    # Extract and normalize the 3 color channels of the image
-    rImage = normalize((rgb[:, :, 0]))
-    gImage = normalize(rgb[:, :, 1])
-    bImage = normalize(rgb[:, :, 2])
+def readImage(image):
+    # Accept either a file name or an already decoded image
+    if isinstance(image, str):
+        return misc.imread(image)
+    return image
 
+def shadowMap(rImage, gImage, bImage, nir):
+    # Compute the shadow map U from the normalized color channels and nir image
 
     # Compute the brightness of the RGB image
     brightness = (rImage + gImage + bImage) / 3
 
-    # Non-linear mapping
-    f = np.vectorize(nonlinearmapping)
-
-    # We normalize the nir image
-    nir = normalize(nir)
-
     # We apply the gamma correction and compute the temporary dark map dVIS and dNIR
     brightness = np.power(brightness, (1.0/gamma))
-    dVIS = f(brightness)
+    dVIS = nonlinearmapping(brightness)
     nir = np.power(nir, (1.0/gamma))
-    dNIR = f(nir)
+    dNIR = nonlinearmapping(nir)
 
     # We get the shadow candidate map D
     D = np.multiply(dVIS, dNIR)
@@ -60,32 +70,55 @@ def shadowDetection(rgb, nir):
     tGreen = np.divide(gImage, nir + 0.0000001)
     tBlue = np.divide(bImage, nir + 0.0000001)
 
-    # Tao is the parameter to upper bound the values t
-    tao = 10
-
-    # We compute the color to NIR ratio map
-    T = (1 / tao) * np.minimum(np.maximum.reduce([tRed, tGreen, tBlue]), tao)
+    # We compute the color to NIR ratio map. 1 / tao was an integer division
+    # under python 2, which the reference masks were computed with: it is
+    # kept explicit so that python 3 gives the same masks
+    T = (1 // tao) * np.minimum(np.maximum.reduce([tRed, tGreen, tBlue]), tao)
 
     # The shadow map U
-    U = np.multiply((1 - D), (1 - T))
+    return np.multiply((1 - D), (1 - T))
+
+def histogramBins(width, height):
+    # Initial number of bins of the shadow map histogram
+    return (nabla * np.ceil(np.log2(width*height) + 1))
+
+def findValley(hist, bins):
+    # Returns the value of the first valley of the histogram, or None if there is none
+    valleyHeight = np.amax(hist)
+    valleyValue = None
+    for x in range(3, len(hist) - 2):
+        if hist[x] < valleyHeight and hist[x] < hist[x-1] < hist[x-2] and hist[x] < hist[x+1] < hist[x+2]:
+            valleyHeight = hist[x]
+            valleyValue = (bins[1] - bins[0]) * (x+0.5)
+    return valleyValue
+
+def shadowDetection(rgb, nir):
+    # Perform the shadow detection algorithm to a pair of rgb and nir images
+
+    rgb = readImage(rgb)
+    nir = readImage(nir)
+
+    rgb = im2double(rgb)
+    nir = im2double(nir)
+
+    # Extract and normalize the 3 color channels of the image
+    rImage = normalize((rgb[:, :, 0]))
+    gImage = normalize(rgb[:, :, 1])
+    bImage = normalize(rgb[:, :, 2])
+
+    # We normalize the nir image
+    nir = normalize(nir)
 
-    nabla = 1.6
-    width = U.shape[0]
-    height = U.shape[1]
-    nbins = (nabla * np.ceil(np.log2(width*height) + 1))
+    # The shadow map U
+    U = shadowMap(rImage, gImage, bImage, nir)
 
-    # Boolean that determines when a valley has been found
-    valleyFound = False
+    nbins = histogramBins(U.shape[0], U.shape[1])
 
     # We find the first valley according to the histogram of the shadow mask
-    while not valleyFound:
+    valleyValue = None
+    while valleyValue is None:
         hist, bins = np.histogram(U, np.floor(nbins).astype('int'))
-        valleyHeight = np.amax(hist)
-        for x in range(3, (np.floor(nbins)-2).astype('int')):
-            if hist[x] < valleyHeight and hist[x] < hist[x-1] < hist[x-2] and hist[x] < hist[x+1] < hist[x+2]:
-                valleyHeight = hist[x]
-                valleyValue = (bins[1] - bins[0]) * (x+0.5)
-                valleyFound = True
+        valleyValue = findValley(hist, bins)
         nbins += 1
 
     Ubin = np.zeros(U.shape)
@@ -93,3 +126,136 @@ def shadowDetection(rgb, nir):
     Ubin[index] = 1
 
     return Ubin
+
+def channelExtrema(rgb, nir):
+    # Global extrema of every channel, computed on the images in their own
+    # pixel type
+    channels = [rgb[:, :, 0], rgb[:, :, 1], rgb[:, :, 2], nir]
+    return [(im2double(np.amin(c)), im2double(np.amax(c))) for c in channels]
+
+def shadowBandMaps(rgb, nir, bandHeight=band_height, extrema=None):
+    # First pass of the streaming version: global extrema of every channel
+    # (channelExtrema, unless given). Returns the bands and a function
+    # computing the shadow map of a band, normalized with the global extrema.
+
+    height = nir.shape[0]
+    bands = [(y, min(y + bandHeight, height)) for y in range(0, height, bandHeight)]
+
+    channels = [rgb[:, :, 0], rgb[:, :, 1], rgb[:, :, 2], nir]
+    if extrema is None:
+        extrema = channelExtrema(rgb, nir)
+
+    def bandMap(y0, y1):
+        # Normalize the strip with the global extrema and compute its shadow map
+        normalized = [(im2double(c[y0:y1]) - minim) / (maxim - minim)
+                      for c, (minim, maxim) in zip(channels, extrema)]
+        return shadowMap(*normalized)
+
+    return bands, bandMap
+
+def shadowValley(bands, bandMap, height, width):
+    # Threshold of the shadow map, found strip by strip
+
+    # Second pass: range of the shadow map, which sets the histogram bins
+    Umin = np.inf
+    Umax = -np.inf
+    for y0, y1 in bands:
+        U = bandMap(y0, y1)
+        Umin = min(Umin, np.amin(U))
+        Umax = max(Umax, np.amax(U))
+
+    # Third pass: accumulate the histograms of several bin counts at once and
+    # look for the first valley, as the full image version does one at a time
+    nbins = histogramBins(height, width)
+    valleyValue = None
+    while valleyValue is None:
+        sizes = [np.floor(nbins + k).astype('int') for k in range(bins_per_pass)]
+        hists = [np.zeros(size, dtype=np.int64) for size in sizes]
+        edges = [None] * len(sizes)
+        for y0, y1 in bands:
+            U = bandMap(y0, y1)
+            for k, size in enumerate(sizes):
+                hist, edges[k] = np.histogram(U, size, (Umin, Umax))
+                hists[k] += hist
+
+        for hist, bins in zip(hists, edges):
+            valleyValue = findValley(hist, bins)
+            if valleyValue is not None:
+                break
+        nbins += bins_per_pass
+
+    return valleyValue
+
+def shadowThreshold(rgb, nir, bandHeight=band_height):
+    # Threshold of the shadow map of a pair of rgb and nir images, e.g. of
+    # downscaled images to warm start the full resolution detection
+
+    rgb = readImage(rgb)
+    nir = readImage(nir)
+
+    bands, bandMap = shadowBandMaps(rgb, nir, bandHeight)
+    return shadowValley(bands, bandMap, nir.shape[0], nir.shape[1])
+
+def shadowDetectionBands(rgb, nir, bandHeight=band_height, valleyValue=None):
+    # Streaming version of shadowDetection: yields (row, mask) pairs where mask
+    # is a boolean strip of at most bandHeight rows starting at row. Only one
+    # strip of double images is alive at any time, so the working memory is
+    # proportional to bandHeight instead of the image size. The strips are
+    # the same as the corresponding rows of shadowDetection(rgb, nir).
+    # If valleyValue is given (e.g. by shadowThreshold on downscaled images),
+    # it is used as the threshold and the histogram passes are skipped.
+
+    rgb = readImage(rgb)
+    nir = readImage(nir)
+
+    bands, bandMap = shadowBandMaps(rgb, nir, bandHeight)
+    if valleyValue is None:
+        valleyValue = shadowValley(bands, bandMap, nir.shape[0], nir.shape[1])
+
+    # Last pass: emit the binary mask strip by strip
+    for y0, y1 in bands:
+        yield y0, bandMap(y0, y1) <= valleyValue
+
+def shadowDetectionMask(rgb, nir, bandHeight=band_height, valleyValue=None):
+    # Perform the shadow detection algorithm in strips and return the result
+    # as a bit-packed ShadowMask
+
+    rgb = readImage(rgb)
+    nir = readImage(nir)
+
+    bands = shadowDetectionBands(rgb, nir, bandHeight, valleyValue)
+    return ShadowMask.fromBands(nir.shape[0], nir.shape[1], bands)
+
+def shadowDetectionLowRes(rgb, nir, scale=lowres_scale, radius=upsampling_radius, eps=upsampling_eps):
+    # Perform the shadow detection on the images reduced by scale, and
+    # upsample the mask with a guided filter following the edges of the full
+    # resolution rgb image. Shadows are low frequency regions, so only their
+    # boundaries need the full resolution, and the guided filter recovers
+    # them from the rgb image. Returns a bit-packed ShadowMask.
+
+    rgb = readImage(rgb)
+    nir = readImage(nir)
+
+    # Every reduced pixel is the mean of its scale x scale block (no
+    # aliasing), centred on the block like the reduced guide of
+    # guided_filter.upsample, so the mask isn't shifted. Averaging narrows
+    # the range of the channels, so the shadow map is normalized with the
+    # extrema of the full resolution images, and its histogram has the bins
+    # of the number of reduced pixels
+    height, width = nir.shape[:2]
+    size = (max(1, width // scale), max(1, height // scale))
+    smallRgb = cv2.resize(rgb, size, interpolation=cv2.INTER_AREA)
+    smallNir = cv2.resize(nir, size, interpolation=cv2.INTER_AREA)
+    bands, bandMap = shadowBandMaps(smallRgb, smallNir, extrema=channelExtrema(rgb, nir))
+    valleyValue = shadowValley(bands, bandMap, size[1], size[0])
+
+    smallMask = np.empty(smallNir.shape, np.float32)
+    for y0, y1 in bands:
+        smallMask[y0:y1] = bandMap(y0, y1) <= valleyValue
+
+    # The luminance of the rgb image (BGR in the pipeline) guides the
+    # upsampling (a color guide gives the same masks for about 5 times the
+    # cost)
+    luminance = cv2.cvtColor(rgb, cv2.COLOR_BGR2GRAY)
+    mask = guided_filter.upsample(luminance, smallMask, radius, eps) >= 0.5
+    return ShadowMask.fromArray(mask)
@@ -0,0 +1,208 @@
+import struct
+
+import numpy as np
+from PIL import Image
+from scipy.sparse import coo_matrix
+from scipy.sparse.csgraph import connected_components
+
+# Number of bits set in every possible byte
+popcount = np.array([bin(i).count('1') for i in range(256)], dtype=np.uint8)
+
+# Header of the run-length encoded files: magic, width, height, number of runs
+rle_magic = b'SMRL'
+rle_header = struct.Struct('<4sIII')
+
+
+class ShadowMask(object):
+    # Binary mask stored with 1 bit per pixel. Every row is packed into
+    # ceil(width / 8) bytes, most significant bit first, and the padding bits
+    # at the end of the rows are always 0 (same layout as numpy.packbits and
+    # as the PIL '1' mode).
+
+    def __init__(self, height, width, packed=None):
+        self.height = height
+        self.width = width
+        if packed is None:
+            packed = np.zeros((height, (width + 7) // 8), dtype=np.uint8)
+        self.packed = packed
+
+    @classmethod
+    def fromArray(cls, mask):
+        # Pack a 2D array where non-zero values are part of the mask
+        mask = np.asarray(mask) != 0
+        return cls(mask.shape[0], mask.shape[1], np.packbits(mask, axis=1))
+
+    @classmethod
+    def fromBands(cls, height, width, bands):
+        # Pack the (row, band) pairs emitted by shadowDetectionBands
+        mask = cls(height, width)
+        for row, band in bands:
+            mask.setBand(row, band)
+        return mask
+
+    def setBand(self, row, band):
+        # Store a strip of rows starting at row
+        self.packed[row:row + band.shape[0]] = np.packbits(band != 0, axis=1)
+
+    def toArray(self):
+        # Unpack the mask into a boolean array
+        return np.unpackbits(self.packed, axis=1)[:, :self.width].astype(bool)
+
+    def count(self):
+        # Number of pixels in the mask
+        return int(popcount[self.packed].sum(dtype=np.int64))
+
+    def areaFraction(self):
+        # Fraction of the image covered by the mask
+        return self.count() / float(self.height * self.width)
+
+    def boundingBox(self):
+        # (x, y, width, height) of the smallest box containing the mask, or
+        # None if the mask is empty
+        rows = np.flatnonzero(self.packed.any(axis=1))
+        if len(rows) == 0:
+            return None
+        columns = np.flatnonzero(np.unpackbits(np.bitwise_or.reduce(self.packed, axis=0)))
+        return (int(columns[0]), int(rows[0]),
+                int(columns[-1] - columns[0] + 1), int(rows[-1] - rows[0] + 1))
+
+    def rowRuns(self):
+        # (rows, starts, ends) of the runs of 1 of every row, in row-major
+        # order, found in the packed rows: a bit differs from the previous
+        # one (0 before the row) where a run starts or ends, and only the
+        # bytes where this happens are unpacked
+        packed = self.packed
+        previous = np.zeros_like(packed)
+        previous[:, 1:] = packed[:, :-1] << 7
+        changes = packed ^ ((packed >> 1) | previous)
+        rows, columns = np.nonzero(changes)
+        index, bits = np.nonzero(np.unpackbits(changes[rows, columns][:, np.newaxis], axis=1))
+        rows = rows[index]
+        positions = columns[index] * 8 + bits
+        if self.width % 8 == 0 and packed.shape[1]:
+            # runs ending at the last bit of the row, which has no padding
+            ending = np.flatnonzero(packed[:, -1] & 1)
+            rows = np.concatenate((rows, ending))
+            positions = np.concatenate((positions, np.full(len(ending), self.width, positions.dtype)))
+            order = np.lexsort((positions, rows))
+            rows, positions = rows[order], positions[order]
+        return rows[0::2], positions[0::2], positions[1::2]
+
+    def regions(self, minArea=1):
+        # (x, y, width, height, area) of every 8-connected region of the mask
+        # covering at least minArea pixels, in the order of their first
+        # pixel. Runs of consecutive rows touching each other (diagonally
+        # included) are joined, without unpacking the mask
+        rows, starts, ends = self.rowRuns()
+        if len(rows) == 0:
+            return []
+
+        # runs of the previous row touching every run: a contiguous range
+        # of the runs sorted in row-major order
+        stride = self.width + 1
+        startKeys = rows * stride + starts
+        endKeys = rows * stride + ends
+        first = np.searchsorted(endKeys, (rows - 1) * stride + starts - 1, 'right')
+        last = np.searchsorted(startKeys, (rows - 1) * stride + ends + 1, 'left')
+        counts = np.maximum(last - first, 0)
+        offsets = np.arange(counts.sum()) - np.repeat(np.cumsum(counts) - counts, counts)
+        below = np.repeat(np.arange(len(rows)), counts)
+        above = np.repeat(first, counts) + offsets
+        graph = coo_matrix((np.ones(len(below), np.int8), (below, above)), shape=(len(rows), len(rows)))
+        count, labels = connected_components(graph, directed=False)
+
+        area = np.bincount(labels, ends - starts, count).astype(np.int64)
+        x0 = np.full(count, self.width, np.int64)
+        x1 = np.zeros(count, np.int64)
+        y0 = np.full(count, self.height, np.int64)
+        y1 = np.zeros(count, np.int64)
+        np.minimum.at(x0, labels, starts)
+        np.maximum.at(x1, labels, ends)
+        np.minimum.at(y0, labels, rows)
+        np.maximum.at(y1, labels, rows + 1)
+        return [(int(x0[i]), int(y0[i]), int(x1[i] - x0[i]), int(y1[i] - y0[i]), int(area[i]))
+                for i in range(count) if area[i] >= minArea]
+
+    def _padding(self):
+        # Mask of the bits of each row that belong to the image
+        valid = np.zeros(self.packed.shape[1] * 8, dtype=bool)
+        valid[:self.width] = True
+        return np.packbits(valid)
+
+    def _check(self, other):
+        if (self.height, self.width) != (other.height, other.width):
+            raise ValueError('Masks have different sizes')
+
+    def __and__(self, other):
+        self._check(other)
+        return ShadowMask(self.height, self.width, self.packed & other.packed)
+
+    def __or__(self, other):
+        self._check(other)
+        return ShadowMask(self.height, self.width, self.packed | other.packed)
+
+    def __xor__(self, other):
+        self._check(other)
+        return ShadowMask(self.height, self.width, self.packed ^ other.packed)
+
+    def __sub__(self, other):
+        self._check(other)
+        return ShadowMask(self.height, self.width, self.packed & ~other.packed)
+
+    def __invert__(self):
+        return ShadowMask(self.height, self.width, ~self.packed & self._padding())
+
+    def __eq__(self, other):
+        return ((self.height, self.width) == (other.height, other.width)
+                and np.array_equal(self.packed, other.packed))
+
+    def __ne__(self, other):
+        return not self == other
+
+    def runLengths(self):
+        # Lengths of the alternating runs of 0 and 1 in row-major order, the
+        # first run being 0 (possibly of length 0), from the runs of the rows
+        # (a run ending a row and one starting the next are the same run)
+        rows, starts, ends = self.rowRuns()
+        size = self.height * self.width
+        starts = rows.astype(np.int64) * self.width + starts
+        ends = rows.astype(np.int64) * self.width + ends
+        joined = np.flatnonzero(ends[:-1] == starts[1:])
+        starts = np.delete(starts, joined + 1)
+        ends = np.delete(ends, joined)
+        bounds = np.concatenate(([0], np.column_stack((starts, ends)).ravel(), [size]))
+        if len(ends) and ends[-1] == size:
+            bounds = bounds[:-1]
+        return np.diff(bounds).astype(np.uint32)
+
+    @classmethod
+    def fromRunLengths(cls, height, width, runs):
+        values = np.arange(len(runs)) % 2 == 1
+        bits = np.repeat(values, runs).reshape(height, width)
+        return cls.fromArray(bits)
+
+    def save(self, filename):
+        # Save the mask as a 1 bit PNG, or run-length encoded for .rle files
+        if filename.endswith('.rle'):
+            runs = self.runLengths()
+            with open(filename, 'wb') as f:
+                f.write(rle_header.pack(rle_magic, self.width, self.height, len(runs)))
+                f.write(runs.astype('<u4').tobytes())
+        else:
+            image = Image.frombytes('1', (self.width, self.height), self.packed.tobytes())
+            image.save(filename)
+
+    @classmethod
+    def load(cls, filename):
+        if filename.endswith('.rle'):
+            with open(filename, 'rb') as f:
+                magic, width, height, count = rle_header.unpack(f.read(rle_header.size))
+                if magic != rle_magic:
+                    raise ValueError('%s is not a run-length encoded mask' % filename)
+                runs = np.frombuffer(f.read(4 * count), dtype='<u4')
+            return cls.fromRunLengths(height, width, runs)
+
+        image = Image.open(filename).convert('1')
+        width, height = image.size
+        packed = np.frombuffer(image.tobytes(), dtype=np.uint8).reshape(height, -1)
+        return cls(height, width, packed.copy())
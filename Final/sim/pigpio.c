@@ -0,0 +1,395 @@
+/*
+ * pigpio.c
+ *
+ * Simulated subset of the pigpio library used by pan-tilt.c (see pigpio.h).
+ */
+
+#include <inttypes.h>
+#include <pigpio.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_ADC_ENV              "PIGPIO_SIM_ADC"
+#define SIM_BUTTON_ENV           "PIGPIO_SIM_BUTTON_MS"
+#define SIM_LOG_ENV              "PIGPIO_SIM_LOG"
+
+#define SIM_GPIOS                (32)
+#define SIM_ADC_CHANNELS         (2)
+#define SIM_ADC_MIDDLE           (2047)
+#define SIM_SERVO_FRAME_US       (20000)
+#define SIM_SAMPLE_US            (5) /* default sample rate of pigpio */
+#define SIM_WAVES                (16)
+#define SIM_WAVE_PULSES          (64)
+#define SIM_NO_WAVE              (-1)
+
+/*
+ * struct sim_gpio_t
+ *
+ * Pulses currently sent on a gpio.
+ */
+struct sim_gpio_t {
+    bool active;
+    uint32_t pulsewidth_us;
+    uint64_t phase_us;        /* start of the pulses in the servo frame */
+    uint64_t last_change_us;  /* frame of the last pulsewidth change */
+    uint32_t changes;
+    uint32_t aligned_changes; /* changes in the same frame as another gpio */
+    bool aligned;             /* the last change is one of them */
+    uint32_t min_step_us;
+};
+
+/*
+ * struct sim_wave_t
+ *
+ * Waveform created by gpioWaveCreate().
+ */
+struct sim_wave_t {
+    bool used;
+    uint32_t num_pulses;
+    uint64_t period_us;
+    gpioPulse_t pulses[SIM_WAVE_PULSES];
+};
+
+/* global variables */
+FILE *sim_log = NULL;
+struct timespec sim_start;
+uint32_t sim_adc[SIM_ADC_CHANNELS] = {SIM_ADC_MIDDLE, SIM_ADC_MIDDLE};
+gpioISRFunc_t sim_isr = NULL;
+unsigned sim_isr_gpio = 0;
+struct sim_gpio_t sim_gpios[SIM_GPIOS];
+struct sim_wave_t sim_waves[SIM_WAVES];
+uint32_t sim_pending_num_pulses = 0;
+gpioPulse_t sim_pending_pulses[SIM_WAVE_PULSES];
+int sim_tx_wave = SIM_NO_WAVE;      /* waveform being transmitted */
+uint64_t sim_tx_start_us = 0;       /* start of its first repetition */
+int sim_next_wave = SIM_NO_WAVE;    /* waveform taking over at sim_next_start_us */
+uint64_t sim_next_start_us = 0;
+
+/*
+ * sim_now_us
+ *
+ * Returns the time since gpioInitialise() in microseconds.
+ */
+uint64_t sim_now_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) (now.tv_sec - sim_start.tv_sec)) * 1000000 + (now.tv_nsec - sim_start.tv_nsec) / 1000;
+}
+
+/*
+ * sim_set_pulse
+ *
+ * Records that a gpio sends pulses of the given width starting at phase_us
+ * in the servo frame, from the frame starting at start_us on.
+ */
+void sim_set_pulse(unsigned gpio, uint32_t pulsewidth_us, uint64_t phase_us, uint64_t start_us, const char *source) {
+    struct sim_gpio_t *g = &sim_gpios[gpio];
+    if (g->active && (g->pulsewidth_us == pulsewidth_us)) {
+        return;
+    }
+
+    if (g->active) {
+        uint32_t step_us = (pulsewidth_us > g->pulsewidth_us) ? pulsewidth_us - g->pulsewidth_us : g->pulsewidth_us - pulsewidth_us;
+        if ((g->min_step_us == 0) || (step_us < g->min_step_us)) {
+            g->min_step_us = step_us;
+        }
+    }
+
+    g->aligned = false;
+    for (unsigned other = 0; other < SIM_GPIOS; other++) {
+        struct sim_gpio_t *o = &sim_gpios[other];
+        if ((other == gpio) || !o->active || (o->last_change_us != start_us)) {
+            continue;
+        }
+        if (!g->aligned) {
+            g->aligned_changes++;
+            g->aligned = true;
+        }
+        if (!o->aligned) {
+            o->aligned_changes++;
+            o->aligned = true;
+        }
+    }
+
+    g->active = true;
+    g->pulsewidth_us = pulsewidth_us;
+    g->phase_us = phase_us;
+    g->last_change_us = start_us;
+    g->changes++;
+    fprintf(sim_log, "%" PRIu64 " %u %" PRIu32 " %s\n", start_us, gpio, pulsewidth_us, source);
+}
+
+/*
+ * sim_start_wave
+ *
+ * Starts transmitting a waveform at start_us: every gpio switched on and off
+ * by the waveform sends the pulse it describes.
+ */
+void sim_start_wave(int wave_id, uint64_t start_us) {
+    struct sim_wave_t *wave = &sim_waves[wave_id];
+    uint64_t rise_us[SIM_GPIOS];
+    uint64_t t_us = 0;
+
+    for (unsigned gpio = 0; gpio < SIM_GPIOS; gpio++) {
+        rise_us[gpio] = UINT64_MAX;
+    }
+
+    for (uint32_t i = 0; i < wave->num_pulses; i++) {
+        gpioPulse_t *pulse = &wave->pulses[i];
+        for (unsigned gpio = 0; gpio < SIM_GPIOS; gpio++) {
+            if (pulse->gpioOn & (1u << gpio)) {
+                rise_us[gpio] = t_us;
+            }
+            if ((pulse->gpioOff & (1u << gpio)) && (rise_us[gpio] != UINT64_MAX)) {
+                sim_set_pulse(gpio, t_us - rise_us[gpio], (start_us + rise_us[gpio]) % SIM_SERVO_FRAME_US, start_us, "wave");
+                rise_us[gpio] = UINT64_MAX;
+            }
+        }
+        t_us += pulse->usDelay;
+    }
+
+    sim_tx_wave = wave_id;
+    sim_tx_start_us = start_us;
+}
+
+/*
+ * sim_update_wave
+ *
+ * Lets a waveform sent in sync take over once the current one has reached
+ * the end of a repetition.
+ */
+void sim_update_wave() {
+    if ((sim_next_wave != SIM_NO_WAVE) && (sim_next_start_us <= sim_now_us())) {
+        sim_start_wave(sim_next_wave, sim_next_start_us);
+        sim_next_wave = SIM_NO_WAVE;
+    }
+}
+
+/*
+ * sim_button_thread
+ *
+ * Presses the joystick button after the delay given in milliseconds.
+ */
+void *sim_button_thread(void *arg) {
+    usleep(((uint32_t) (uintptr_t) arg) * 1000);
+    if (sim_isr != NULL) {
+        sim_isr(sim_isr_gpio, 1, (uint32_t) sim_now_us());
+    }
+    return NULL;
+}
+
+int gpioInitialise(void) {
+    clock_gettime(CLOCK_MONOTONIC, &sim_start);
+
+    sim_log = stderr;
+    const char *log_file = getenv(SIM_LOG_ENV);
+    if (log_file != NULL) {
+        sim_log = fopen(log_file, "w");
+        if (sim_log == NULL) {
+            return -1;
+        }
+    }
+
+    const char *adc = getenv(SIM_ADC_ENV);
+    if (adc != NULL) {
+        sscanf(adc, "%" SCNu32 " %" SCNu32, &sim_adc[0], &sim_adc[1]);
+    }
+
+    const char *button_ms = getenv(SIM_BUTTON_ENV);
+    if (button_ms != NULL) {
+        pthread_t thread;
+        pthread_create(&thread, NULL, sim_button_thread, (void *) (uintptr_t) strtoul(button_ms, NULL, 10));
+        pthread_detach(thread);
+    }
+
+    return 0;
+}
+
+void gpioTerminate(void) {
+    sim_update_wave();
+
+    for (unsigned gpio = 0; gpio < SIM_GPIOS; gpio++) {
+        struct sim_gpio_t *g = &sim_gpios[gpio];
+        if (g->active) {
+            fprintf(sim_log, "# gpio %u: %" PRIu32 " changes, phase %" PRIu64 " us, smallest step %" PRIu32 " us, %" PRIu32 " changes aligned with another gpio\n",
+                    gpio, g->changes, g->phase_us, g->min_step_us, g->aligned_changes);
+        }
+    }
+
+    if (sim_log != stderr) {
+        fclose(sim_log);
+    }
+}
+
+int gpioSetMode(unsigned gpio, unsigned mode) {
+    (void) mode;
+    return (gpio < SIM_GPIOS) ? 0 : PI_BAD_USER_GPIO;
+}
+
+int gpioSetPullUpDown(unsigned gpio, unsigned pud) {
+    (void) pud;
+    return (gpio < SIM_GPIOS) ? 0 : PI_BAD_USER_GPIO;
+}
+
+int gpioSetISRFunc(unsigned gpio, unsigned edge, int timeout, gpioISRFunc_t f) {
+    (void) edge;
+    (void) timeout;
+    sim_isr = f;
+    sim_isr_gpio = gpio;
+    return 0;
+}
+
+int gpioSetSignalFunc(unsigned signum, gpioSignalFunc_t f) {
+    return (signal(signum, f) == SIG_ERR) ? PI_BAD_SIGNUM : 0;
+}
+
+int gpioSetPWMfrequency(unsigned user_gpio, unsigned frequency) {
+    return (user_gpio < SIM_GPIOS) ? (int) frequency : PI_BAD_USER_GPIO;
+}
+
+int gpioSetPWMrange(unsigned user_gpio, unsigned range) {
+    return (user_gpio < SIM_GPIOS) ? (int) range : PI_BAD_USER_GPIO;
+}
+
+int gpioServo(unsigned user_gpio, unsigned pulsewidth) {
+    if (user_gpio >= SIM_GPIOS) {
+        return PI_BAD_USER_GPIO;
+    }
+    if ((pulsewidth != 0) && ((pulsewidth < 500) || (2500 < pulsewidth))) {
+        return PI_BAD_PULSEWIDTH;
+    }
+
+    /* the first pulse sets the frame phase of the gpio, later pulsewidths
+       take effect at its next frame */
+    struct sim_gpio_t *g = &sim_gpios[user_gpio];
+    uint64_t now_us = sim_now_us();
+    uint64_t phase_us = g->active ? g->phase_us : now_us % SIM_SERVO_FRAME_US;
+    uint64_t start_us = now_us;
+    if (g->active) {
+        start_us = now_us - (now_us % SIM_SERVO_FRAME_US) + phase_us;
+        if (start_us < now_us) {
+            start_us += SIM_SERVO_FRAME_US;
+        }
+    }
+
+    sim_set_pulse(user_gpio, (pulsewidth / SIM_SAMPLE_US) * SIM_SAMPLE_US, phase_us, start_us, "servo");
+    return 0;
+}
+
+int gpioWaveClear(void) {
+    memset(sim_waves, 0, sizeof(sim_waves));
+    sim_pending_num_pulses = 0;
+    sim_tx_wave = SIM_NO_WAVE;
+    sim_next_wave = SIM_NO_WAVE;
+    return 0;
+}
+
+int gpioWaveAddGeneric(unsigned numPulses, gpioPulse_t *pulses) {
+    if (sim_pending_num_pulses + numPulses > SIM_WAVE_PULSES) {
+        return PI_TOO_MANY_PULSES;
+    }
+
+    memcpy(&sim_pending_pulses[sim_pending_num_pulses], pulses, numPulses * sizeof(gpioPulse_t));
+    sim_pending_num_pulses += numPulses;
+    return (int) sim_pending_num_pulses;
+}
+
+int gpioWaveCreate(void) {
+    for (int wave_id = 0; wave_id < SIM_WAVES; wave_id++) {
+        struct sim_wave_t *wave = &sim_waves[wave_id];
+        if (!wave->used) {
+            wave->used = true;
+            wave->num_pulses = sim_pending_num_pulses;
+            wave->period_us = 0;
+            memcpy(wave->pulses, sim_pending_pulses, sim_pending_num_pulses * sizeof(gpioPulse_t));
+            for (uint32_t i = 0; i < wave->num_pulses; i++) {
+                wave->period_us += wave->pulses[i].usDelay;
+            }
+            sim_pending_num_pulses = 0;
+            return wave_id;
+        }
+    }
+    return PI_NO_WAVEFORM_ID;
+}
+
+int gpioWaveDelete(unsigned wave_id) {
+    sim_update_wave();
+    if ((wave_id >= SIM_WAVES) || !sim_waves[wave_id].used) {
+        return PI_BAD_WAVE_ID;
+    }
+    if (((int) wave_id == sim_tx_wave) || ((int) wave_id == sim_next_wave)) {
+        fprintf(sim_log, "# error: wave %u deleted while transmitted\n", wave_id);
+    }
+
+    sim_waves[wave_id].used = false;
+    return 0;
+}
+
+int gpioWaveTxSend(unsigned wave_id, unsigned wave_mode) {
+    if ((wave_id >= SIM_WAVES) || !sim_waves[wave_id].used) {
+        return PI_BAD_WAVE_ID;
+    }
+    if (wave_mode > PI_WAVE_MODE_REPEAT_SYNC) {
+        return PI_BAD_WAVE_MODE;
+    }
+
+    sim_update_wave();
+    uint64_t now_us = sim_now_us();
+    bool sync = (wave_mode == PI_WAVE_MODE_ONE_SHOT_SYNC) || (wave_mode == PI_WAVE_MODE_REPEAT_SYNC);
+
+    if (!sync || (sim_tx_wave == SIM_NO_WAVE) || (sim_waves[sim_tx_wave].period_us == 0)) {
+        /* starts right away, cutting the current repetition short */
+        sim_next_wave = SIM_NO_WAVE;
+        sim_start_wave(wave_id, now_us);
+        return 0;
+    }
+
+    /* takes over at the end of the current repetition */
+    uint64_t period_us = sim_waves[sim_tx_wave].period_us;
+    uint64_t repetitions = (now_us - sim_tx_start_us + period_us - 1) / period_us;
+    sim_next_wave = wave_id;
+    sim_next_start_us = sim_tx_start_us + repetitions * period_us;
+    return 0;
+}
+
+int gpioWaveTxAt(void) {
+    sim_update_wave();
+    return (sim_tx_wave == SIM_NO_WAVE) ? PI_NO_TX_WAVE : sim_tx_wave;
+}
+
+int gpioWaveTxStop(void) {
+    sim_tx_wave = SIM_NO_WAVE;
+    sim_next_wave = SIM_NO_WAVE;
+    return 0;
+}
+
+int spiOpen(unsigned spiChan, unsigned baud, unsigned spiFlags) {
+    (void) spiChan;
+    (void) baud;
+    (void) spiFlags;
+    return 0;
+}
+
+int spiClose(unsigned handle) {
+    (void) handle;
+    return 0;
+}
+
+int spiXfer(unsigned handle, char *txBuf, char *rxBuf, unsigned count) {
+    (void) handle;
+    /* MCP3204 style transfer: the channel is selected by the top bits of the
+       second byte, the 12-bit result is in the last two bytes */
+    uint32_t channel = (((uint8_t) txBuf[1]) >> 6) % SIM_ADC_CHANNELS;
+    uint32_t value = sim_adc[channel];
+
+    memset(rxBuf, 0, count);
+    rxBuf[1] = (value >> 8) & 0xf;
+    rxBuf[2] = value & 0xff;
+    return (int) count;
+}
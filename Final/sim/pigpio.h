@@ -0,0 +1,95 @@
+/*
+ * pigpio.h
+ *
+ * Simulated subset of the pigpio library used by pan-tilt.c, to run the
+ * pan-tilt control program without the Raspberry Pi, the joystick and the
+ * servos:
+ *     gcc -std=gnu11 -Wall -funsigned-char -Isim pan-tilt.c sim/pigpio.c -o pan-tilt-sim -pthread
+ *
+ * The simulation is configured with environment variables:
+ *   - PIGPIO_SIM_ADC="<channel 0> <channel 1>": values read from the joystick
+ *     ADC channels, in [0, 4095] (default: both centered)
+ *   - PIGPIO_SIM_BUTTON_MS=<ms>: time after gpioInitialise() at which the
+ *     joystick button is pressed (default: never)
+ *   - PIGPIO_SIM_LOG=<file>: file receiving the log of the servo pulses
+ *     (default: stderr)
+ *
+ * Every change of a servo pulse is logged with the time (us since
+ * gpioInitialise()) of the servo frame it takes effect in:
+ *     <time> <gpio> <pulsewidth> servo|wave
+ * gpioTerminate() then logs a summary per gpio: the number of changes, the
+ * phase of the pulses in the 20 ms servo frame, the smallest pulsewidth step
+ * and the number of changes that took effect in the same frame as a change
+ * of another gpio.
+ *
+ * gpioServo() outputs are modelled as independent outputs, each with its own
+ * frame phase (set by its first pulse), and pulsewidths in steps of the
+ * default sample rate (5 us). Waveforms are modelled as repeated from their
+ * start, with pulsewidths in steps of 1 us.
+ */
+
+#ifndef PIGPIO_H
+#define PIGPIO_H
+
+#include <stdint.h>
+
+#define PI_INPUT                 (0)
+#define PI_OUTPUT                (1)
+
+#define PI_PUD_OFF               (0)
+#define PI_PUD_DOWN              (1)
+#define PI_PUD_UP                (2)
+
+#define RISING_EDGE              (0)
+#define FALLING_EDGE             (1)
+#define EITHER_EDGE              (2)
+
+#define PI_WAVE_MODE_ONE_SHOT      (0)
+#define PI_WAVE_MODE_REPEAT        (1)
+#define PI_WAVE_MODE_ONE_SHOT_SYNC (2)
+#define PI_WAVE_MODE_REPEAT_SYNC   (3)
+
+#define PI_BAD_USER_GPIO         (-2)
+#define PI_BAD_SIGNUM            (-70)
+#define PI_BAD_PULSEWIDTH        (-7)
+#define PI_BAD_DUTYRANGE         (-21)
+#define PI_BAD_WAVE_MODE         (-33)
+#define PI_TOO_MANY_PULSES       (-36)
+#define PI_BAD_WAVE_ID           (-66)
+#define PI_NO_WAVEFORM_ID        (-69)
+#define PI_WAVE_NOT_FOUND        (9998)
+#define PI_NO_TX_WAVE            (9999)
+
+typedef struct {
+    uint32_t gpioOn;
+    uint32_t gpioOff;
+    uint32_t usDelay;
+} gpioPulse_t;
+
+typedef void (*gpioISRFunc_t)(int gpio, int level, uint32_t tick);
+typedef void (*gpioSignalFunc_t)(int signum);
+
+int gpioInitialise(void);
+void gpioTerminate(void);
+int gpioSetMode(unsigned gpio, unsigned mode);
+int gpioSetPullUpDown(unsigned gpio, unsigned pud);
+int gpioSetISRFunc(unsigned gpio, unsigned edge, int timeout, gpioISRFunc_t f);
+int gpioSetSignalFunc(unsigned signum, gpioSignalFunc_t f);
+
+int gpioSetPWMfrequency(unsigned user_gpio, unsigned frequency);
+int gpioSetPWMrange(unsigned user_gpio, unsigned range);
+int gpioServo(unsigned user_gpio, unsigned pulsewidth);
+
+int gpioWaveClear(void);
+int gpioWaveAddGeneric(unsigned numPulses, gpioPulse_t *pulses);
+int gpioWaveCreate(void);
+int gpioWaveDelete(unsigned wave_id);
+int gpioWaveTxSend(unsigned wave_id, unsigned wave_mode);
+int gpioWaveTxAt(void);
+int gpioWaveTxStop(void);
+
+int spiOpen(unsigned spiChan, unsigned baud, unsigned spiFlags);
+int spiClose(unsigned handle);
+int spiXfer(unsigned handle, char *txBuf, char *rxBuf, unsigned count);
+
+#endif /* PIGPIO_H */
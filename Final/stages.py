@@ -0,0 +1,344 @@
+import cv2
+import numpy
+
+import decode
+import dehazing
+import demosaic
+import graph
+import pipeline
+import rawframe
+import merging
+import normalization
+import pixel
+import registration
+import shadow_detection
+
+# frame names
+nir_jpeg = 'nir_jpeg'
+rgb_jpeg = 'rgb_jpeg'
+nir_raw = 'nir_raw'
+rgb_raw = 'rgb_raw'
+rgbn_raw = 'rgbn_raw'
+rgbn_mosaic = 'rgbn_mosaic'
+nir = 'nir'
+rgb = 'rgb'
+nir_normalized = 'nir_normalized'
+homography = 'homography'
+nir_registered = 'nir_registered'
+skin_smoothing = 'skin_smoothing'
+shadow_detection_mask = 'shadow_detection'
+shadow_threshold = 'shadow_threshold'
+dehazing_image = 'dehazing'
+airlight = 'airlight'
+capture_index = 'index'
+capture_time = 'capture_time'
+pose = 'pose'
+operation = 'operation'
+
+# processing parameters
+merge_parameters = dict(d=30, sigmaC=15, sigmaS=5)
+
+# reduction of the preview images (1/2, 1/4 or 1/8, decoded by the scaled
+# inverse DCT)
+preview_scale = 4
+# preview latency target in seconds, previews taking longer are reported
+preview_budget = 1.0
+# use the preview threshold for the full resolution shadow detection instead
+# of searching the histogram valley again: about 3 times faster, but the mask
+# only has an IoU of about 0.8 with the one of the full search
+warm_start_threshold = False
+
+# 1 to detect shadows at full resolution, or subsampling of the low
+# resolution detection (shadow_detection.shadowDetectionLowRes)
+shadow_scale = 1
+
+def shadow_parameters():
+    parameters = dict((name, getattr(shadow_detection, name)) for name in ('alpha', 'beta', 'gamma', 'tao', 'nabla'))
+    parameters['scale'] = shadow_scale
+    return parameters
+
+def dehazing_parameters():
+    return dehazing.parameters()
+
+def parameters():
+    # parameters the outputs depend on, recorded with the captures
+    return {
+        'merge': dict(merge_parameters),
+        'shadow': shadow_parameters(),
+        'dehazing': dehazing_parameters(),
+    }
+
+def set_parameters(parameters):
+    # applies parameters as returned by parameters(), e.g. on a remote worker
+    global shadow_scale
+    merge_parameters.update(parameters['merge'])
+    shadow = dict(parameters['shadow'])
+    shadow_scale = shadow.pop('scale')
+    for name, value in shadow.items():
+        setattr(shadow_detection, name, value)
+    for name, value in parameters.get('dehazing', {}).items():
+        setattr(dehazing, name, value)
+
+# what the stages need from the captured JPEG images: the nir image is only
+# used as luma, so its chroma components are not decoded
+decode_requests = {
+    nir: decode.Request(channels=1),
+    rgb: decode.Request(channels=3),
+}
+
+def scaled(name, scale):
+    # name of the frame decoded at 1/scale of the resolution
+    return '%s/%d' % (name, scale)
+
+def downscaler(scale):
+    return lambda image: cv2.resize(image, ((image.shape[1] + scale - 1) // scale, (image.shape[0] + scale - 1) // scale),
+                                    interpolation=cv2.INTER_AREA)
+
+def add_scaled_frames(g, scale, raw=False):
+    """
+    Adds nir and rgb frames decoded at 1/scale of the resolution directly
+    from the JPEG images (scaled inverse DCT), for the stages that work on a
+    reduced image, and returns their names. Raw captures are downscaled
+    from the nir and rgb frames instead.
+    """
+    names = []
+    for name, jpeg in ((nir, nir_jpeg), (rgb, rgb_jpeg)):
+        request = decode_requests[name]
+        if raw:
+            g.add(graph.Node(scaled(name, scale), downscaler(scale), [name]))
+        else:
+            g.add(graph.Node(scaled(name, scale), decode.decoder(decode.Request(request.channels, scale)), [jpeg]))
+        names.append(scaled(name, scale))
+    return names
+
+def grayscale_spec(image):
+    return (image.shape[:2], image.dtype)
+
+def normalize(nir, dst=None):
+    return normalization.normalize(nir, dst)
+
+def find_homography(nir_normalized, rgb):
+    # homography mapping the nir image on the rgb one (color images are
+    # decoded as BGR)
+    return registration.find_homography(nir_normalized, cv2.cvtColor(rgb, cv2.COLOR_BGR2GRAY))
+
+def register(nir_normalized, rgb, homography, dst=None):
+    return registration.warp(nir_normalized, homography, rgb.shape, dst)
+
+def register_spec(nir_normalized, rgb, homography):
+    return grayscale_spec(rgb)
+
+def identity_homography(rgb):
+    # the images of a single RGB-NIR sensor are pixel-aligned
+    return numpy.eye(3)
+
+def aligned(nir_normalized, rgb, homography, dst=None):
+    # registered nir image of pixel-aligned images: no warp
+    if dst is None:
+        return nir_normalized.copy()
+    numpy.copyto(dst, nir_normalized)
+    return dst
+
+def refine_homography(nir_normalized, rgb, coarse_homography, scale):
+    # full resolution homography, warm started from the one of the images
+    # reduced by scale
+    prior = registration.scale_homography(coarse_homography, scale)
+    return registration.refine_homography(nir_normalized, cv2.cvtColor(rgb, cv2.COLOR_BGR2GRAY), prior, 2.0 * scale)
+
+def merge(rgb, nir_registered):
+    return merging.merge(rgb, nir_registered, **merge_parameters)
+
+def scaled_merge_parameters(scale):
+    # bilateral filter reduced like the image
+    return dict(merge_parameters, d=max(1, merge_parameters['d'] // scale),
+                sigmaS=max(1, merge_parameters['sigmaS'] // scale))
+
+def shadow(rgb, nir_registered, threshold=None):
+    if shadow_scale > 1 and threshold is None:
+        return shadow_detection.shadowDetectionLowRes(rgb, nir_registered, shadow_scale)
+    # processed in strips to keep the memory usage bounded at full resolution
+    return shadow_detection.shadowDetectionMask(rgb, nir_registered, valleyValue=threshold)
+
+def find_shadow_threshold(rgb, nir_registered):
+    return shadow_detection.shadowThreshold(rgb, nir_registered)
+
+def estimate_airlight(rgb, scale=1):
+    return dehazing.estimate(rgb, scale)
+
+def dehaze(rgb, nir_registered, airlight, scale=1, dst=None):
+    # processed in tiles on all the cores, written to a pooled buffer
+    return dehazing.dehaze(rgb, nir_registered, airlight, scale, dst)
+
+def dehaze_spec(rgb, nir_registered, airlight):
+    return (rgb.shape, rgb.dtype)
+
+def add_preview(g, scale, raw=False, rgbn=False):
+    """
+    Adds the nodes processing the capture at 1/scale of the resolution:
+    scaled(name, scale) for the nir_registered, skin_smoothing,
+    shadow_detection, dehazing frames and the homography, shadow threshold
+    and airlight they are computed with. The pixel-aligned images of an
+    RGB-NIR sensor (rgbn) are not registered.
+    """
+    small_nir, small_rgb = add_scaled_frames(g, scale, raw or rgbn)
+    g.add(graph.Node(scaled(nir_normalized, scale), normalize, [small_nir], output_spec=grayscale_spec))
+    if rgbn:
+        g.add(graph.Node(scaled(homography, scale), identity_homography, [small_rgb]))
+    else:
+        g.add(graph.Node(scaled(homography, scale), find_homography, [scaled(nir_normalized, scale), small_rgb]))
+    g.add(graph.Node(scaled(nir_registered, scale), aligned if rgbn else register,
+                     [scaled(nir_normalized, scale), small_rgb, scaled(homography, scale)], output_spec=register_spec))
+    g.add(graph.Node(scaled(skin_smoothing, scale), lambda rgb, nir: merging.merge(rgb, nir, **scaled_merge_parameters(scale)),
+                     [small_rgb, scaled(nir_registered, scale)], parameters=lambda: scaled_merge_parameters(scale)))
+    g.add(graph.Node(scaled(shadow_threshold, scale), find_shadow_threshold, [small_rgb, scaled(nir_registered, scale)],
+                     parameters=shadow_parameters))
+    g.add(graph.Node(scaled(shadow_detection_mask, scale), shadow, [small_rgb, scaled(nir_registered, scale), scaled(shadow_threshold, scale)],
+                     parameters=shadow_parameters))
+    g.add(graph.Node(scaled(airlight, scale), lambda rgb: estimate_airlight(rgb, scale), [small_rgb], parameters=dehazing_parameters))
+    g.add(graph.Node(scaled(dehazing_image, scale), lambda rgb, nir, airlight, dst=None: dehaze(rgb, nir, airlight, scale, dst),
+                     [small_rgb, scaled(nir_registered, scale), scaled(airlight, scale)], output_spec=dehaze_spec,
+                     parameters=dehazing_parameters))
+
+def write_bytes(filename, data):
+    with open(filename, 'wb') as f:
+        f.write(data)
+
+def write_image(filename, image):
+    # PNG and TIFF files keep high bit depth images in 16 bits, the other
+    # formats (JPEG) only store 8-bit images
+    if not filename.lower().endswith(('.png', '.tif', '.tiff')):
+        image = pixel.to_uint8(image)
+    elif image.dtype == numpy.float32:
+        image = pixel.from_float(image, numpy.uint16)
+    return cv2.imwrite(filename, image)
+
+def write_mask(filename, mask):
+    mask.save(filename)
+
+def missing_source():
+    raise ValueError('the captured images must be given as sources')
+
+def build_graph(capture=None, frame_cache=None, preview=False, raw=False, rgbn=False):
+    """
+    Processing graph of one capture. capture() returns the encoded (nir, rgb)
+    images; without it, the nir_jpeg and rgb_jpeg frames (or the decoded nir
+    and rgb frames) must be given as sources when running the graph. Raw
+    captures give the nir and rgb images directly, and their nir_raw and
+    rgb_raw frames (rawframe.RawFrame) for the sinks. A homography given as
+    source (e.g. replayed from an archive) is used instead of registering the
+    images again.
+
+    With a cache.Cache, the frames computed from the given sources are
+    cached, so that processing a capture again (with another operation or
+    other parameters) only runs the nodes affected.
+
+    With preview, the capture is first processed at 1/preview_scale of the
+    resolution (add_preview; raw tells whether the captures are raw frames),
+    and the full resolution registration is warm started from the preview
+    homography.
+
+    With rgbn, the captures are the raw mosaics of a single RGB-NIR sensor,
+    given as the rgbn_raw frame (rawframe.RawFrame) and its rgbn_mosaic
+    pixels: they are separated into pixel-aligned nir and rgb images
+    (demosaic.py), which are not registered.
+    """
+    g = graph.Graph(frame_cache)
+    g.add(graph.Node(capture_index, missing_source, cached=False))
+    g.add(graph.Node('capture info', missing_source, outputs=[capture_time, pose, operation], cached=False))
+    if capture is not None:
+        g.add(graph.Node('capture', capture, outputs=[nir_jpeg, rgb_jpeg], cached=False))
+    else:
+        g.add(graph.Node('source', missing_source, outputs=[nir_jpeg, rgb_jpeg], cached=False))
+    g.add(graph.Node('raw source', missing_source, outputs=[nir_raw, rgb_raw], cached=False))
+    if rgbn:
+        g.add(graph.Node('mosaic source', missing_source, outputs=[rgbn_raw, rgbn_mosaic], cached=False))
+        g.add(graph.Node('demosaic', demosaic.demosaic, [rgbn_mosaic], outputs=[nir, rgb],
+                         parameters=lambda: {'layout': demosaic.layout, 'crosstalk': demosaic.crosstalk}))
+    else:
+        g.add(graph.Node(nir, decode.decoder(decode_requests[nir]), [nir_jpeg]))
+        g.add(graph.Node(rgb, decode.decoder(decode_requests[rgb]), [rgb_jpeg]))
+    g.add(graph.Node(nir_normalized, normalize, [nir], output_spec=grayscale_spec))
+    if preview:
+        add_preview(g, preview_scale, raw, rgbn)
+    if rgbn:
+        g.add(graph.Node(homography, identity_homography, [rgb]))
+        g.add(graph.Node(nir_registered, aligned, [nir_normalized, rgb, homography], output_spec=register_spec))
+    elif preview:
+        g.add(graph.Node(homography, lambda nir, rgb, coarse: refine_homography(nir, rgb, coarse, preview_scale),
+                         [nir_normalized, rgb, scaled(homography, preview_scale)]))
+        g.add(graph.Node(nir_registered, register, [nir_normalized, rgb, homography], output_spec=register_spec))
+    else:
+        g.add(graph.Node(homography, find_homography, [nir_normalized, rgb]))
+        g.add(graph.Node(nir_registered, register, [nir_normalized, rgb, homography], output_spec=register_spec))
+    g.add(graph.Node(skin_smoothing, merge, [rgb, nir_registered], parameters=lambda: merge_parameters))
+    if preview and warm_start_threshold:
+        g.add(graph.Node(shadow_detection_mask, shadow, [rgb, nir_registered, scaled(shadow_threshold, preview_scale)],
+                         parameters=shadow_parameters))
+    else:
+        g.add(graph.Node(shadow_detection_mask, shadow, [rgb, nir_registered], parameters=shadow_parameters))
+    g.add(graph.Node(airlight, estimate_airlight, [rgb], parameters=dehazing_parameters))
+    g.add(graph.Node(dehazing_image, dehaze, [rgb, nir_registered, airlight], output_spec=dehaze_spec,
+                     parameters=dehazing_parameters))
+    return g
+
+def add_file_sink(g, input, filename):
+    """
+    Adds a node encoding the frame named input to filename and returns its
+    name. If filename contains a %d, it is replaced by the capture_index
+    frame, which must then be given as a source.
+    """
+    name = 'write ' + filename
+    # scaled frames are written as the full resolution ones
+    base = input.split('/')[0]
+    if base in (nir_jpeg, rgb_jpeg):
+        writer = write_bytes
+    elif base in (nir_raw, rgb_raw, rgbn_raw):
+        writer = rawframe.write
+    elif base == shadow_detection_mask:
+        writer = write_mask
+    else:
+        writer = write_image
+
+    if '%' in filename:
+        function = lambda data, index: writer(filename % index, data)
+        g.add(graph.Node(name, function, [input, capture_index], []))
+    else:
+        g.add(graph.FileSink(name, input, filename, writer))
+    return name
+
+def add_archive_sink(g, writer, raw=False):
+    """
+    Adds a node appending the captured images (raw frames if raw) with their
+    capture time, pose, homography and the processing parameters to an
+    archive.Writer, and returns its name. The capture_time, pose and
+    operation frames must be given as sources.
+    """
+    name = 'archive ' + writer.filename
+    inputs = [nir_raw, rgb_raw] if raw else [nir_jpeg, rgb_jpeg]
+
+    def append(nir, rgb, timestamp, pose, homography, operation):
+        writer.append(nir, rgb, timestamp, pose, homography, {'operation': operation, 'parameters': parameters()})
+
+    g.add(graph.Node(name, append, inputs + [capture_time, pose, homography, operation], []))
+    return name
+
+def pipeline_stages(g, preview=False, offloader=None):
+    """
+    Splits the graph in stages for pipeline.Pipeline: decoding and
+    normalization, registration, then the operations and the sinks asked for
+    by the job, the operations running concurrently when there are several
+    of them. With preview, a first stage computes the preview targets of the
+    job. With an offload.Offloader, registration and the operations run
+    locally or on the remote worker, whichever is expected to be faster.
+    """
+    preview_stages = [('preview', pipeline.preview_stage(g))] if preview else []
+    register_stage = pipeline.graph_stage(g, [homography, nir_registered])
+    process_stage = pipeline.graph_stage(g, branches=True)
+    if offloader is not None:
+        register_stage = offloader.stage('register', g, register_stage, [homography, nir_registered])
+        process_stage = offloader.stage('process', g, process_stage)
+    return preview_stages + [
+        ('normalize', pipeline.graph_stage(g, [rgb, nir_normalized])),
+        ('register', register_stage),
+        ('process', process_stage),
+    ]
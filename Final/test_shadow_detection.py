@@ -0,0 +1,47 @@
+#!/usr/bin/python2
+
+"""
+Checks the low resolution shadow detection against the full resolution one,
+with the bound of benchmark.py (min_lowres_iou) on the sets it bounds.
+
+    ./test_shadow_detection.py
+"""
+
+import unittest
+
+import cv2
+import numpy
+
+import benchmark
+import shadow_detection
+
+
+class LowResTest(unittest.TestCase):
+
+    def masks(self, directory, nir):
+        # low and full resolution masks of a set
+        rgb = cv2.imread(benchmark.path(directory + 'rgb.jpg'), cv2.IMREAD_COLOR)
+        nir_image = cv2.imread(benchmark.path(directory + nir), cv2.IMREAD_GRAYSCALE)
+        return (shadow_detection.shadowDetectionLowRes(rgb, nir_image).toArray() != 0,
+                shadow_detection.shadowDetectionMask(rgb, nir_image).toArray() != 0)
+
+    def test_iou(self):
+        for directory, nir, reference in benchmark.shadow_sets:
+            if reference is None:
+                continue
+            mask, expected = self.masks(directory, nir)
+            self.assertGreaterEqual(benchmark.iou(mask, expected), benchmark.min_lowres_iou, directory)
+
+    def test_alignment(self):
+        # the mask isn't shifted from the full resolution one: no shift of
+        # up to 2 pixels matches it better
+        for directory, nir, _ in benchmark.shadow_sets:
+            mask, expected = self.masks(directory, nir)
+            iou = benchmark.iou(mask, expected)
+            for dy in range(-2, 3):
+                for dx in range(-2, 3):
+                    shifted = numpy.roll(numpy.roll(mask, dy, axis=0), dx, axis=1)
+                    self.assertGreaterEqual(iou, benchmark.iou(shifted, expected), (directory, dy, dx))
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,162 @@
+#!/usr/bin/python2
+
+"""
+Low-overhead tracing of the capture and processing pipeline.
+
+Spans are recorded in a buffer owned by the thread recording them, so no
+lock is taken on the recording path, and exported in the Chrome trace event
+format (chrome://tracing, https://ui.perfetto.dev). Timestamps come from the
+system clock, which ptpd keeps synchronized between the units, so traces of
+both units (and of the pan-tilt program) can be merged on one timeline:
+
+    ./tracing.py merge trace.json client-trace.json server-trace.json
+
+Tracing is enabled by setting NIR_TRACE to the file the trace is written to.
+"""
+
+import json
+import os
+import socket
+import sys
+import threading
+import time
+
+# trace file, tracing is disabled if not set
+trace_file = os.environ.get('NIR_TRACE')
+enabled = trace_file is not None
+
+# name of this unit in the trace
+process_name = socket.gethostname()
+
+# per-thread buffers: (thread id, thread name, events)
+buffers = []
+buffers_lock = threading.Lock()
+local = threading.local()
+
+# events loaded from other traces (e.g. the pan-tilt program)
+imported = []
+
+def thread_buffer():
+    try:
+        return local.events
+    except AttributeError:
+        # first event of this thread: register its buffer (only time the lock is taken)
+        local.events = []
+        thread = threading.current_thread()
+        with buffers_lock:
+            buffers.append((thread.ident, thread.name, local.events))
+        return local.events
+
+
+class Span(object):
+
+    __slots__ = ('name', 'category', 'args', 'start')
+
+    def __init__(self, name, category, args):
+        self.name = name
+        self.category = category
+        self.args = args
+
+    def __enter__(self):
+        self.start = time.time()
+        return self
+
+    def __exit__(self, type, value, traceback):
+        thread_buffer().append((self.name, self.category, self.start, time.time(), self.args))
+        return False
+
+
+class NullSpan(object):
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, type, value, traceback):
+        return False
+
+null_span = NullSpan()
+
+def span(name, category='', **args):
+    # context manager recording the time spent in its block
+    if not enabled:
+        return null_span
+    return Span(name, category, args)
+
+def instant(name, category='', **args):
+    # records an event without duration
+    if enabled:
+        now = time.time()
+        thread_buffer().append((name, category, now, None, args))
+
+def enable(filename=None):
+    global enabled, trace_file
+    enabled = True
+    if filename is not None:
+        trace_file = filename
+
+def load(filename):
+    # imports the events of another trace file into this one
+    imported.extend(read_events(filename))
+
+def read_events(filename):
+    with open(filename) as f:
+        trace = json.load(f)
+    if isinstance(trace, dict):
+        return trace.get('traceEvents', [])
+    return trace
+
+def events():
+    # trace events of this process, in the Chrome trace event format
+    pid = os.getpid()
+    result = [{'name': 'process_name', 'ph': 'M', 'pid': pid, 'tid': 0, 'args': {'name': process_name}}]
+
+    with buffers_lock:
+        snapshot = list(buffers)
+    for tid, thread_name, thread_events in snapshot:
+        result.append({'name': 'thread_name', 'ph': 'M', 'pid': pid, 'tid': tid, 'args': {'name': thread_name}})
+        for name, category, start, end, args in list(thread_events):
+            event = {'name': name, 'cat': category, 'pid': pid, 'tid': tid, 'ts': start * 1e6, 'args': args}
+            if end is None:
+                event['ph'] = 'i'
+                event['s'] = 't'
+            else:
+                event['ph'] = 'X'
+                event['dur'] = (end - start) * 1e6
+            result.append(event)
+
+    return result + imported
+
+def write(filename, trace_events):
+    with open(filename, 'w') as f:
+        json.dump({'traceEvents': trace_events, 'displayTimeUnit': 'ms'}, f)
+
+def export(filename=None):
+    # writes the trace to filename (NIR_TRACE by default)
+    filename = filename or trace_file
+    if filename is not None:
+        write(filename, events())
+
+def merge(output, filenames):
+    # merges trace files, giving distinct process ids to the processes of
+    # different files (the units may reuse the same pids)
+    merged = []
+    used = set()
+    for filename in filenames:
+        mapping = {}
+        for event in read_events(filename):
+            pid = event.get('pid', 0)
+            if pid not in mapping:
+                new_pid = pid
+                while new_pid in used:
+                    new_pid += 100000
+                mapping[pid] = new_pid
+                used.add(new_pid)
+            event['pid'] = mapping[pid]
+            merged.append(event)
+    write(output, merged)
+
+if __name__ == '__main__':
+    if len(sys.argv) < 4 or sys.argv[1] != 'merge':
+        print('usage: %s merge <output> <trace> <trace>...' % sys.argv[0])
+        sys.exit(1)
+    merge(sys.argv[2], sys.argv[3:])